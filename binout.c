@@ -0,0 +1,143 @@
+/* subtree pruning-regrafting (spr) library
+ * Peter Cordes <peter@cordes.ca>, Dalhousie University
+ * license: GPLv2 or later
+ */
+
+/* Binary neighbour lists, ~16 bytes a tree instead of a line of newick.
+ * File layout: header, the start tree's newick (newicklen bytes, with the ;
+ * and no nul), then struct spr_binrecs to the end. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define SPR_PRIVATE
+#include "spr.h"
+
+#define MAGIC "allsprNB"
+#define VERSION 1
+#define BLOCK (1 << 20)		// bytes per write(2)
+
+struct header{
+	char magic[8];
+	uint32_t version, nodes, taxa, newicklen;
+};
+
+struct spr_binwriter{
+	int fd;
+	size_t len;
+	char *buf;	// BLOCK bytes
+};
+
+static int drain( struct spr_binwriter *w, const char *p, size_t len )
+{
+	ssize_t got;
+	while (len){
+		if ((got = write(w->fd, p, len)) < 0){
+			if (errno == EINTR) continue;
+			return FALSE;
+		}
+		p += got;
+		len -= got;
+	}
+	return TRUE;
+}
+
+static int flushbuf( struct spr_binwriter *w )
+{
+	int ok = drain(w, w->buf, w->len);
+	w->len = 0;
+	return ok;
+}
+
+struct spr_binwriter *spr_binwriter_new( int fd, const struct spr_tree *t )
+{
+	struct spr_binwriter *w = xmalloc(sizeof(*w));
+	struct spr_newickbuf b = { NULL, 0, 0 };
+	struct header h;
+
+	w->fd = fd;
+	w->len = 0;
+	w->buf = xmalloc(BLOCK);
+	spr_newick_buf(&b, t, t->root, NULL, NULL);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, 8);
+	h.version = VERSION;
+	h.nodes = t->nodes;
+	h.taxa = t->taxa;
+	h.newicklen = b.len;
+	if (!drain(w, (const char *)&h, sizeof(h)) || !drain(w, b.s, b.len)){
+		spr_newickbuf_free(&b);
+		free(w->buf);
+		free(w);
+		return NULL;
+	}
+	spr_newickbuf_free(&b);
+	return w;
+}
+
+int spr_binwriter_put( struct spr_binwriter *w, uint32_t parent, int sprnum, unsigned long long fp )
+{
+	struct spr_binrec rec = { parent, sprnum, fp };
+	if (w->len + sizeof(rec) > BLOCK && !flushbuf(w))
+		return FALSE;
+	memcpy(w->buf + w->len, &rec, sizeof(rec));
+	w->len += sizeof(rec);
+	return TRUE;
+}
+
+int spr_binwriter_close( struct spr_binwriter *w )
+{
+	int ok = flushbuf(w);
+	free(w->buf);
+	free(w);
+	return ok;
+}
+
+
+struct spr_binreader *spr_binreader_open( const char *path, const char **err )
+{
+	struct spr_binreader *r = xcalloc(1, sizeof(*r));
+	struct header h;
+
+	if (!(r->f = fopen(path, "rb"))){
+		*err = strerror(errno);
+		free(r);
+		return NULL;
+	}
+	setvbuf(r->f, NULL, _IOFBF, BLOCK);
+	if (1 != fread(&h, sizeof(h), 1, r->f) || memcmp(h.magic, MAGIC, 8) || h.version != VERSION){
+		*err = "not a binary neighbour list";
+		goto fail;
+	}
+	r->nodes = h.nodes;
+	r->taxa = h.taxa;
+	r->newick = xmalloc(h.newicklen + 1);
+	if (1 != fread(r->newick, h.newicklen, 1, r->f)){
+		*err = "truncated in the start tree";
+		goto fail;
+	}
+	r->newick[h.newicklen] = '\0';
+	return r;
+ fail:
+	spr_binreader_close(r);
+	return NULL;
+}
+
+int spr_binreader_next( struct spr_binreader *r, struct spr_binrec *rec )
+{
+	size_t got = fread(rec, 1, sizeof(*rec), r->f);
+	if (got == sizeof(*rec)) return 1;
+	return got == 0 && feof(r->f) && !ferror(r->f) ? 0 : -1;
+}
+
+void spr_binreader_close( struct spr_binreader *r )
+{
+	fclose(r->f);
+	free(r->newick);
+	free(r);
+}
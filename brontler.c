@@ -10,8 +10,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <assert.h>
 
 
@@ -21,10 +26,11 @@
 #ifndef SPR_PROCOV_DATA
 
 // example payload that we use in the non-procov case.  Only name is actually used.
+// It starts like struct spr_newickdata, so spr_parse_newick can fill it in.
 struct nodedata{
 	char *name;
+	double bl;		/* branch length to parent, < 0 if none */
 	int dirty;		/* needs likelihood update after SPR? */
-	float bl;		/* branch length to parent */
 	float (*dna)[4];	/* 4xn matrix */
 };
 /* request that spr_node::data be declared as a pointer to our actual payload type,
@@ -37,20 +43,50 @@ struct nodedata{
 
 // globals
 int debug = 1;
+int stats = FALSE;
+int shard = 0, nshards = 1;	// -x
+int unordered = FALSE;		// -u
+struct spr_binwriter *bin = NULL;	// -b
 
 // TODO: option to control printing the starting tree?
 const char *usage=
 "usage: brontler [options] tree [src dest]\n"
 " brontler '(((a,b),(g,(e,f))),(c,d))' dump all unique SPRs\n"
-" brontler '(a,(c,b))' a c\t- SPR from a to c.  (internal nodes have capital letter names...)\n"
+"  brontler '(a,((c,d)X,b))' a X\t- SPR from a to X.  Only labelled internal nodes can be named.\n"
 "options: -h, -V: help and version\n"
 "\t-t tree\tread tree from a file instead of the command line\n"
+"\t-g n[,model]\tstart from a random tree of n taxa, instead of reading one.\n"
+"\t\tmodel: uniform (default), yule, caterpillar or balanced\n"
+"\t-s seed\tfor -g (default 1)\n"
+"\t-p\tjust print the starting tree\n"
+"\t-M\twith -t, do every tree in the file in turn (e.g. one per line).  They must all have the same taxa.\n"
 "\t-d number\tdebug/verbosity level (default 0)\n"
 "\t-D number\tallspr library debug/verbosity level (default 0)\n"
 "\t-m mode\t0: just exhaust SPRs from the starting tree. (default)\n"
 "\t  1: exhaust SPRs from the starting tree, then start from the last SPR.\n"
 "\t  2: take the SPRed topology as a new start point 50% of the time.\n"
 "\t-T n\twhen mode>0, don't start a new tree after n unique topologies. (default 0, unlimited)\n"
+"\t-j n\tfind each tree's neighbours with n threads (default 1).  Output order varies.\n"
+"\t-c n\twhen mode>0, run n search chains from the starting tree, with seeds 1..n,\n"
+"\t\ton -j threads.  -T limits the total for all chains.\n"
+"\t-u\twith -j, each thread writes its own blocks of trees, without waiting for the others.\n"
+"\t\tFaster, but the lines come out of order.\n"
+"\t-G\twith -c, chains share one set of visited topologies.\n"
+"\t-r\tprint neighbours from cached pieces of the start tree.  Not with -c.\n"
+"\t-x i/N\tin mode 0, only do shard i (0..N-1) of the SPRs.  N runs with -P, one per shard,\n"
+"\t\tfind the same trees between them as one run.  sprmerge puts their -P files together.\n"
+"\t-b file\twrite neighbours to file as binary records (see sprdecode), not as newick on stdout.\n"
+"\t\tIn mode 0, records only have fingerprints with -C.  Not with -c, -M or -R.\n"
+"\t-C\tin mode 0, check for duplicate topologies anyway (there shouldn't be any).\n"
+"\t-P file\tkeep the set of seen topologies in file, on disk.  Topologies already in\n"
+"\t\tit from an earlier run count as dups.  Not with -c or -M.\n"
+"\t-k file\twrite checkpoints to file, to carry on from later with -R.  Not with -c or -M.\n"
+"\t\tWith -j or -r, only between tree iterations.\n"
+"\t-K n[s]\twith -k, checkpoint every n new topologies, or every n seconds (default 60s).\n"
+"\t-R\tresume from the -k file, if it exists.  Give the same tree and options as before.\n"
+"\t\tTrees found after the checkpoint are printed again, unless -P already has them.\n"
+"\t-S\tprint counters and latency histograms on stderr at the end.\n"
+"\t\tNeeds the library built with -DSPR_STATS.\n"
 "\tboth non-zero modes only stop when no non-duplicate SPRs can be done.\n";
 
 const char *version="brontler v2.0. allspr library version " ALLSPR_VERSION "\n";
@@ -73,7 +109,9 @@ static struct spr_node *newnode(char *name)
 }
 
 
-/* grammar:
+#ifdef SPR_PROCOV_DATA
+/* procov's name is an array, so spr_parse_newick can't fill in its payload.
+ * grammar:
  *   subtree: (subtree,subtree) | taxon
  *   taxon: name | name:bl
  *   name: string not including (, ) or :.
@@ -86,10 +124,11 @@ static struct spr_node *newnode(char *name)
  * should be re-written to use yacc/bison and lex/flex.
  *
  * returns root node of a tree 
- * len is the number of characters this subtree was */
-struct spr_node *parsenewick( char *str, int *len )
+ * len is the number of characters this subtree was.
+ * nextname is the name for the next internal node; the caller owns it,
+ * so there's no static state.  start it at "A". */
+struct spr_node *parsenewick( char *str, int *len, char *nextname )
 {
-	static char nextname[] = { 'A', '\0' };
 	int tmp;
 //	char *name;
 	struct spr_node *node = newnode(NULL);
@@ -103,7 +142,7 @@ struct spr_node *parsenewick( char *str, int *len )
 #endif // procov
 		++*nextname;
 
-		node->left = parsenewick(str+1, &tmp);
+		node->left = parsenewick(str+1, &tmp, nextname);
 		node->left->parent = node;
 		*len = tmp+1;
 
@@ -114,7 +153,7 @@ struct spr_node *parsenewick( char *str, int *len )
 		else
 			*len += tmp;
 
-		node->right = parsenewick(str+*len, &tmp);
+		node->right = parsenewick(str+*len, &tmp, nextname);
 		node->right->parent = node;
 		*len += tmp;
 
@@ -122,7 +161,7 @@ struct spr_node *parsenewick( char *str, int *len )
 		if(',' == str[*len]){
 			struct spr_node *newroot = newnode("root");
 			newroot->left = node; node->parent = newroot;
-			newroot->right = parsenewick(str + ++*len, &tmp);
+			newroot->right = parsenewick(str + ++*len, &tmp, nextname);
 			*len += tmp;
 			newroot->right->parent = newroot;
 			node = newroot;
@@ -153,6 +192,7 @@ struct spr_node *parsenewick( char *str, int *len )
 
 	return node;
 }
+#endif // procov
 
 /* build up a little tree by hand for testing */
 static void sprtest(void)
@@ -208,64 +248,495 @@ char *readfile(char *file)
 	return buf;
 }
 
+/* The output thread.  Trees are formatted into big chunks, and full ones are
+ * queued for a thread that write()s them to stdout, so enumerating only
+ * waits on a slow pipe or disk when every chunk is in the queue.  Chunks
+ * come back to a free list, so we stop allocating once there are enough.
+ * By default all threads fill one chunk, under printstate's lock, so lines
+ * come out in treecount order.  With -u, each -j thread fills its own, and
+ * hands it in when it's full or the thread exits. */
+#define CHUNK (256 << 10)	// bytes per write(2)
+#define QUEUE 4			// full chunks waiting for the writer, at most
+
+struct chunk{
+	struct chunk *next, *nextall;	// in the queue or free list; in out.all
+	char *buf;
+	size_t len, size;
+	struct spr_newickbuf nb;	// scratch for the tree being added
+};
+
+struct output{
+	pthread_mutex_t lock;
+	pthread_cond_t work, room;	// chunks queued or stopping; a chunk freed or the queue drained
+	struct chunk *head, *tail, *free, *all;
+	int chunks, maxchunks, writing, stop;
+	pthread_t thread;
+	pthread_key_t mine;		// -u: the calling thread's chunk
+} out = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void *output_main(void *arg)
+{
+	struct chunk *c;
+	const char *p;
+	ssize_t got;
+	size_t left;
+
+	pthread_mutex_lock(&out.lock);
+	for (;;){
+		while (!out.head && !out.stop) pthread_cond_wait(&out.work, &out.lock);
+		if (!(c = out.head)) break;
+		if (!(out.head = c->next)) out.tail = NULL;
+		out.writing = TRUE;
+		pthread_mutex_unlock(&out.lock);
+		for (p = c->buf, left = c->len ; left ; p += got, left -= got)
+			if ((got = write(STDOUT_FILENO, p, left)) < 0){
+				if (errno == EINTR){ got = 0; continue; }
+				perror("brontler: writing trees");
+				exit(2);
+			}
+		pthread_mutex_lock(&out.lock);
+		c->len = 0;
+		c->next = out.free;
+		out.free = c;
+		out.writing = FALSE;
+		pthread_cond_broadcast(&out.room);
+	}
+	pthread_mutex_unlock(&out.lock);
+	return NULL;
+}
+
+// an empty chunk, waiting for the writer if they're all in use
+static struct chunk *chunk_get(void)
+{
+	struct chunk *c;
+	pthread_mutex_lock(&out.lock);
+	while (!out.free && out.chunks >= out.maxchunks) pthread_cond_wait(&out.room, &out.lock);
+	if ((c = out.free)) out.free = c->next;
+	else{
+		c = xcalloc(1, sizeof(*c));
+		c->buf = xmalloc(c->size = CHUNK);
+		c->nextall = out.all;
+		out.all = c;
+		out.chunks++;
+	}
+	pthread_mutex_unlock(&out.lock);
+	return c;
+}
+
+// queue c for writing (or just free it, if it's empty)
+static void chunk_put(struct chunk *c)
+{
+	pthread_mutex_lock(&out.lock);
+	if (!c->len){
+		c->next = out.free;
+		out.free = c;
+		pthread_cond_broadcast(&out.room);
+	}else{
+		c->next = NULL;
+		if (out.tail) out.tail->next = c;
+		else out.head = c;
+		out.tail = c;
+		pthread_cond_signal(&out.work);
+	}
+	pthread_mutex_unlock(&out.lock);
+}
+
+static void chunk_exit(void *c){ chunk_put(c); }
+
+/* append head and the tree to *cp, handing it to the writer first if
+ * they don't fit.  rope may be NULL */
+static void chunk_add(struct chunk **cp, const char *head, struct spr_tree *t, struct spr_rope *rope)
+{
+	struct chunk *c = *cp;
+	size_t hlen = strlen(head), need;
+
+	if (!c) c = *cp = chunk_get();
+	if (rope) spr_rope_buf(rope, t, &c->nb);
+	else spr_newick_buf(&c->nb, t, t->root, NULL, NULL);
+	need = hlen + c->nb.len + 1;
+	if (c->len + need > c->size && c->len){
+		struct spr_newickbuf nb = c->nb; // the tree goes with us to the next chunk
+		c->nb = (*cp = chunk_get())->nb;
+		(*cp)->nb = nb;
+		chunk_put(c);
+		c = *cp;
+	}
+	if (need > c->size) c->buf = xrealloc(c->buf, c->size = need); // a huge tree
+	memcpy(c->buf + c->len, head, hlen);
+	memcpy(c->buf + c->len + hlen, c->nb.s, c->nb.len);
+	c->len += need;
+	c->buf[c->len - 1] = '\n';
+}
+
+// start the writer thread, for up to nthreads threads filling chunks at once
+static void output_start(int nthreads)
+{
+	out.maxchunks = QUEUE + nthreads;
+	out.stop = FALSE;
+	fflush(stdout); // anything printf()ed comes first
+	if (pthread_key_create(&out.mine, chunk_exit) || pthread_create(&out.thread, NULL, output_main, NULL)){
+		perror("brontler: starting output thread");
+		exit(2);
+	}
+}
+
+/* hand in *cp (may be NULL), and wait for everything queued to be written,
+ * so printf() can carry on after it.  Only while nobody else is adding trees */
+static void output_sync(struct chunk **cp)
+{
+	if (*cp) chunk_put(*cp);
+	*cp = NULL;
+	pthread_mutex_lock(&out.lock);
+	while (out.head || out.writing) pthread_cond_wait(&out.room, &out.lock);
+	pthread_mutex_unlock(&out.lock);
+}
+
+static void output_stop(struct chunk **cp)
+{
+	struct chunk *c;
+	output_sync(cp);
+	pthread_mutex_lock(&out.lock);
+	out.stop = TRUE;
+	pthread_cond_signal(&out.work);
+	pthread_mutex_unlock(&out.lock);
+	pthread_join(out.thread, NULL);
+	pthread_key_delete(out.mine);
+	while ((c = out.all)){
+		out.all = c->nextall;
+		spr_newickbuf_free(&c->nb);
+		free(c->buf);
+		free(c);
+	}
+	out.free = NULL;
+	out.chunks = 0;
+}
+
+// counters for printing neighbours.  shared by the threads with -j
+struct printstate{
+	pthread_mutex_t lock;
+	int treecount, treeiter, bestspr, spr_mode;
+	struct spr_rope *rope;	// NULL to print with spr_newick_write
+	int oldtreecount;
+	unsigned coins;		// rand() calls, for -m2
+	struct chunk *chunk;	// the one being filled, or NULL
+	int ownchunks;		// -u: each thread fills its own
+};
+
+// what a checkpoint needs besides the library's state.  -R starts from it
+struct progress{
+	int treecount, treeiter, bestspr, oldtreecount;
+	unsigned coins;
+};
+
+// -k, -K and -R
+struct checkpointing{
+	const char *file;	// NULL for no checkpoints
+	long every;		// topologies, or
+	int secs;		// seconds, between them
+	int resumed;		// from, if so
+	struct progress from;
+	int lastcount;
+	time_t lasttime;
+} ckpt = { NULL, 0, 60, FALSE };
+
+// at a point where the tree and its dup set aren't in use by other threads
+static void checkpoint(struct spr_tree *sprtree, struct printstate *ps, int force)
+{
+	struct progress pr = { ps->treecount, ps->treeiter, ps->bestspr, ps->oldtreecount, ps->coins };
+	time_t now;
+
+	if (!ckpt.file) return;
+	if (!force){
+		if (ckpt.every){
+			if (ps->treecount - ckpt.lastcount < ckpt.every) return;
+		}else if ((now = time(NULL)) - ckpt.lasttime < ckpt.secs) return;
+	}
+	output_sync(&ps->chunk); // everything up to here is out before the checkpoint says so
+	if (!spr_checkpoint(sprtree, ckpt.file, &pr, sizeof(pr))){
+		perror("brontler: writing checkpoint");
+		exit(2);
+	}
+	if (debug>=2) fprintf(stderr, "checkpoint at %d trees\n", ps->treecount);
+	ckpt.lastcount = ps->treecount;
+	ckpt.lasttime = time(NULL);
+}
+
+// print one neighbour.  return TRUE to stop looking for more
+static int print_neighbour(struct spr_tree *sprtree, int sprnum, void *arg)
+{
+	struct printstate *ps = arg;
+	struct chunk *mine;
+	char head[64];
+	int stop, count;
+
+	pthread_mutex_lock(&ps->lock);
+	count = ++ps->treecount;
+	if (debug>=4) spr_treedump(sprtree, stderr);
+	if (bin){
+		if (!spr_binwriter_put(bin, ps->treeiter, sprnum, sprtree->dups ? spr_fingerprint(sprtree) : 0)){
+			perror("brontler: writing binary output");
+			exit(2);
+		}
+	}else if (debug != 3 && !ps->ownchunks){ // in case you want just #trees/iteration
+		snprintf(head, sizeof(head), "%d: tree %d.%d: ", count, ps->treeiter, sprnum);
+		chunk_add(&ps->chunk, head, sprtree, ps->rope);
+	}
+	ps->bestspr = sprnum;
+	stop = (ps->spr_mode==2 && (ps->coins++, rand()%2));
+	pthread_mutex_unlock(&ps->lock);
+
+	if (!bin && debug != 3 && ps->ownchunks){ // the newick, outside the lock
+		snprintf(head, sizeof(head), "%d: tree %d.%d: ", count, ps->treeiter, sprnum);
+		mine = pthread_getspecific(out.mine);
+		chunk_add(&mine, head, sprtree, NULL);
+		pthread_setspecific(out.mine, mine);
+	}
+	return stop;
+}
+
 // This is where the action is:
 // enumerate the possible SPRs, one per line with various counters.
 // see usage string for meaning of mode.
-static int allspr(struct spr_tree *sprtree, int spr_mode, long topolimit)
+// rope is NULL, or one that's been reset for sprtree
+static int allspr(struct spr_tree *sprtree, int spr_mode, long topolimit, int nthreads, struct spr_rope *rope)
 {
-	int treeiter, bestspr, treecount, sprnum;
-	int oldtreecount=0, tmp;
+	struct printstate ps = { PTHREAD_MUTEX_INITIALIZER, 0, 1, 0, spr_mode, rope, 0, 0 };
+	int sprnum, tmp;
 	printf ("tree: taxa: %d, nodes: %d, possible SPRs <= %d\n",
 		sprtree->taxa, sprtree->nodes, sprtree->lcg.m );
 	// tree->lcg.state = 16;
+	if (ckpt.resumed){ // the library has the rest.  replay -m2's coin flips
+		ps.treecount = ckpt.from.treecount;
+		ps.treeiter = ckpt.from.treeiter;
+		ps.bestspr = ckpt.from.bestspr;
+		ps.oldtreecount = ckpt.from.oldtreecount;
+		for (ps.coins=0 ; ps.coins < ckpt.from.coins ; ps.coins++) rand();
+	}
+	ckpt.lastcount = ps.treecount;
+	ckpt.lasttime = time(NULL);
+	ps.ownchunks = unordered && nthreads > 1 && !rope; // the rope is one thread at a time anyway
+	output_start(nthreads);
+
+	for(;;){
+		if (nthreads > 1) // checkpoints only between iterations, like with -r
+			spr_parallel_neighbours(sprtree, nthreads, print_neighbour, &ps);
+		else
+			while ( (sprnum = spr_next_spr(sprtree)) ){
+				if (print_neighbour(sprtree, sprnum, &ps)) break;
+				if (!ps.rope) checkpoint(sprtree, &ps, FALSE); // a rope needs the start topology
 
-	for(treecount=0, treeiter=1 ; ; treeiter++){
-		bestspr = 0;
-		while ( (sprnum = spr_next_spr(sprtree)) ){
-			++treecount;
-			if (debug>=4) spr_treedump(sprtree, stderr);
-			if (debug != 3){ // in case you want just #trees/iteration
-				printf("%d: tree %d.%d: ", treecount, treeiter, sprnum);
-				newickprint(sprtree->root, stdout);
 			}
-			bestspr = sprnum;
-			if (spr_mode==2 && rand()%2) break;
-		}
 
 		if (debug>=1){
-			printf("tree iteration %d gave %d new trees\n", treeiter, treecount-oldtreecount);
-			oldtreecount = treecount;
+			output_sync(&ps.chunk);
+			printf("tree iteration %d gave %d new trees\n", ps.treeiter, ps.treecount-ps.oldtreecount);
+			fflush(stdout);
+			ps.oldtreecount = ps.treecount;
 		}
 
-		if (spr_mode > 0 && (!topolimit || treecount < topolimit) && bestspr){
-			tmp = spr_apply_sprnum(sprtree, bestspr);
+		if (spr_mode > 0 && (!topolimit || ps.treecount < topolimit) && ps.bestspr){
+			tmp = spr_apply_sprnum(sprtree, ps.bestspr);
 			assert ( tmp /* spr_apply_sprnum should always succeed */ );
+			if (ps.rope) spr_rope_reset(ps.rope, sprtree);
 		}else break;
+		ps.treeiter++;
+		ps.bestspr = 0;
+		checkpoint(sprtree, &ps, FALSE);
 	}
+	checkpoint(sprtree, &ps, TRUE); // so -R of a finished run has nothing left to do
+	output_stop(&ps.chunk);
 	return TRUE;
 }
 
+static void print_chain_neighbour(struct spr_tree *sprtree, int chain, int iteration, int sprnum, void *arg)
+{
+	struct printstate *ps = arg;
+	char head[64];
+
+	pthread_mutex_lock(&ps->lock);
+	++ps->treecount;
+	if (debug>=4) spr_treedump(sprtree, stderr);
+	if (debug != 3){
+		snprintf(head, sizeof(head), "%d: chain %d tree %d.%d: ", ps->treecount, chain+1, iteration, sprnum);
+		chunk_add(&ps->chunk, head, sprtree, NULL);
+	}
+	pthread_mutex_unlock(&ps->lock);
+}
+
+// -S, for the whole run.  -j workers and -c chains add theirs to sprtree's.
+static void printstats(const struct spr_tree *sprtree)
+{
+	struct spr_stats st;
+	if (!spr_stats(sprtree, &st)){
+		fputs("brontler: -S: the library was built without SPR_STATS\n", stderr);
+		return;
+	}
+	spr_stats_print(&st, stderr);
+}
+
+// modes 1 and 2 with many chains, on the library's multi-start driver.
+static int allspr_chains(struct spr_tree *sprtree, int spr_mode, long topolimit,
+	int nthreads, int nchains, int shared)
+{
+	struct printstate ps = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, spr_mode, NULL, 0, 0 };
+	struct spr_searchopts opts = { nthreads, spr_mode, topolimit, shared, print_chain_neighbour, &ps, sprtree->stats };
+	struct spr_chain *chains = xcalloc(nchains, sizeof(*chains));
+	long found;
+	int i;
+
+	printf ("tree: taxa: %d, nodes: %d, possible SPRs <= %d\n",
+		sprtree->taxa, sprtree->nodes, sprtree->lcg.m );
+	for (i=0 ; i<nchains ; i++){
+		chains[i].start = sprtree->root;
+		chains[i].seed = i+1;
+	}
+	output_start(nthreads);
+	found = spr_search_run(chains, nchains, &opts);
+	output_stop(&ps.chunk);
+	if (debug>=1)
+		for (i=0 ; i<nchains ; i++)
+			printf("chain %d: %d iterations gave %ld new trees\n",
+				i+1, chains[i].iterations, chains[i].found);
+	free(chains);
+	return found >= 0;
+}
+
+#ifndef SPR_PROCOV_DATA
+/* -M: every tree in a file, one after another.  The file is mmapped, and each
+ * tree is parsed straight out of the mapping into the same arena, with taxon
+ * names from one table.  The first tree decides the taxa.  The library state,
+ * dup set and rope are reused from one tree to the next. */
+static int allspr_stream(const char *file, int spr_mode, long topolimit, int nthreads,
+	int nchains, int shared, int rope, int dupcheck)
+{
+	struct spr_taxontable taxa;
+	struct spr_newicktree parsed;
+	struct spr_tree *sprtree = NULL;
+	struct spr_rope *r = NULL;
+	struct stat st;
+	const char *map, *err;
+	size_t pos = 0, end, size;
+	int fd, ok = TRUE, ntrees = 0;
+
+	if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st)){
+		perror("brontler: error opening tree file");
+		exit(2);
+	}
+	if (!(size = st.st_size)){
+		fprintf(stderr, "brontler: %s: no trees\n", file);
+		close(fd);
+		return FALSE;
+	}
+	if (MAP_FAILED == (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0))){
+		perror("brontler: error mapping tree file");
+		exit(2);
+	}
+	madvise((void *)map, size, MADV_SEQUENTIAL);
+	spr_taxontable_init(&taxa);
+	spr_newicktree_init(&parsed, &taxa);
+
+	for (;;){
+		while (pos < size && strchr(" \t\n\r\f\v", map[pos]) && map[pos]) pos++;
+		if (pos >= size) break;
+		if (!spr_parse_newick(&parsed, map + pos, size - pos, sizeof(struct nodedata), &end, &err)){
+			fprintf(stderr, "brontler: %s: bad tree %d at offset %zu: %s\n", file, ntrees+1, pos + end, err);
+			ok = FALSE;
+			break;
+		}
+		pos += end;
+		ntrees++;
+		taxa.frozen = TRUE;
+
+		if (sprtree ? !spr_reinit(sprtree, parsed.root)
+		            : !(sprtree = spr_init(parsed.root, NULL, spr_mode == 0 && !dupcheck))){
+			fprintf(stderr, "brontler: %s: couldn't init libspr for tree %d\n", file, ntrees);
+			ok = FALSE;
+			break;
+		}
+		spr_setshard(sprtree, shard, nshards);
+		if (debug>=2){
+			printf("starting tree %d:\n", ntrees);
+			spr_newick_write(stdout, sprtree, sprtree->root, NULL, NULL);
+			putchar('\n');
+		}
+		if (spr_mode > 0 && nchains > 0)
+			ok = allspr_chains(sprtree, spr_mode, topolimit, nthreads, nchains, shared);
+		else{
+			if (rope && !r) r = spr_rope_new(sprtree);
+			else if (r) spr_rope_reset(r, sprtree);
+			ok = allspr(sprtree, spr_mode, topolimit, nthreads, r);
+		}
+		if (!ok) break;
+	}
+
+	if (r) spr_rope_free(r);
+	if (sprtree && stats) printstats(sprtree);
+	if (sprtree) spr_statefree(sprtree);
+	spr_newicktree_free(&parsed);
+	spr_taxontable_free(&taxa);
+	munmap((void *)map, size);
+	close(fd);
+	return ok;
+}
+#endif
+
 int main (int argc, char *argv[])
 {
 	struct spr_tree *sprtree;
 	struct spr_node *root, *src, *dest;
 	char *treestring = NULL;
-	int spr_mode=0, topolimit=0;
-	int i, tmp, retval=0;
+#ifdef SPR_PROCOV_DATA
+	char nextname[] = "A";
+#else
+	struct spr_newicktree parsed;
+	const char *err;
+	size_t end;
+#endif
+	int spr_mode=0, topolimit=0, nthreads=1, nchains=0, shared=FALSE, dupcheck=FALSE, rope=FALSE;
+	char *treefile = NULL, *gen = NULL, *storefile = NULL, *binfile = NULL;
+	int stream = FALSE, printonly = FALSE;
+	unsigned long long seed = 1;
+	struct spr_rope *r = NULL;
+	int i, tmp, retval=0, binfd = -1;
 	
 //	srand( time(NULL) );
 	srand( 42 );
 
 	opterr = 1; // make getopt print specific error messages for us
-	while ((i = getopt (argc, argv, "hVD:d:m:t:T:")) != -1){
+	while ((i = getopt (argc, argv, "b:hCVc:D:d:g:Gj:k:K:m:MpP:rRs:St:T:ux:")) != -1){
 	  switch(i){
+	  case 'b': binfile=optarg; break;
 	  case 'h': puts(usage);   return 0;
 	  case 'V': puts(version); return 0;
 	  case 'd': debug=atoi(optarg); break;
+	  case 'c': nchains=atoi(optarg); break;
+	  case 'C': dupcheck=TRUE; break;
 	  case 'D': spr_setdebug(atoi(optarg)); break;
+	  case 'g': gen=optarg; break;
+	  case 'G': shared=TRUE; break;
+	  case 'j': nthreads=atoi(optarg); break;
+	  case 'k': ckpt.file=optarg; break;
+	  case 'K':
+		if (strchr(optarg, 's')) ckpt.secs=atoi(optarg);
+		else{ ckpt.every=atol(optarg); ckpt.secs=0; }
+		break;
 	  case 'm': spr_mode=atoi(optarg); break;
-	  case 't': treestring=readfile(optarg); break;
+	  case 'M': stream=TRUE; break;
+	  case 'p': printonly=TRUE; break;
+	  case 'P': storefile=optarg; break;
+	  case 'r': rope=TRUE; break;
+	  case 'R': ckpt.resumed=TRUE; break;
+	  case 's': seed=strtoull(optarg, NULL, 0); break;
+	  case 'S': stats=TRUE; break;
+	  case 't': treefile=optarg; break;
 	  case 'T': topolimit=atoi(optarg); break;
+	  case 'u': unordered=TRUE; break;
+	  case 'x':
+		if (2 != sscanf(optarg, "%d/%d", &shard, &nshards) || nshards < 1 || shard < 0 || shard >= nshards){
+			fprintf(stderr, "brontler: bad -x %s: want i/N, with 0 <= i < N\n", optarg);
+			return 1;
+		}
+		break;
 	  case '?':
 		  fputs("you need -h (help)\n", stderr);
 		  return 1;
@@ -275,7 +746,46 @@ int main (int argc, char *argv[])
 	}
 
 	if (42 == debug) sprtest();
+	if (nshards > 1 && spr_mode != 0){
+		// later start trees depend on the whole neighbourhood
+		fputs("brontler: -x only works in mode 0\n", stderr);
+		return 1;
+	}
+	if (rope && nchains > 0){
+		// chains print from their own trees, which the rope doesn't follow
+		fputs("brontler: -r doesn't work with -c\n", stderr);
+		return 1;
+	}
 
+	if (stream){
+#ifdef SPR_PROCOV_DATA
+		fputs("brontler: -M needs the library's newick parser, which procov payloads can't use\n", stderr);
+		return 1;
+#else
+		if (!treefile || argc != optind || storefile || ckpt.file || binfile){
+			fputs("brontler: -M needs -t file, and no other arguments, -P, -k or -b\n", stderr);
+			return 1;
+		}
+		retval = !allspr_stream(treefile, spr_mode, topolimit, nthreads, nchains, shared, rope, dupcheck);
+		spr_staticfree();
+		return retval;
+#endif
+	}
+	if (treefile) treestring = readfile(treefile);
+
+#ifndef SPR_PROCOV_DATA
+	if (gen){ // -g N[,model]
+		char *comma = strchr(gen, ',');
+		int model = comma ? spr_treemodel(comma+1) : SPR_TREE_UNIFORM;
+		spr_newicktree_init(&parsed, NULL);
+		if (!spr_randomtree(&parsed, atoi(gen), model, seed, sizeof(struct nodedata))){
+			fprintf(stderr, "brontler: can't generate a tree from -g %s\n", gen);
+			return 1;
+		}
+		root = parsed.root;
+		goto have_tree;
+	}
+#endif
 	if (!treestring){ // take the tree from the command line
 		if ((argc - optind) < 1){
 			fputs("brontler: error: no tree specified\n", stderr);
@@ -286,32 +796,114 @@ int main (int argc, char *argv[])
 	}
 
 	// parse tree and print it out
-	root = parsenewick(treestring, &tmp); // assert (tmp == strlen)...
+#ifdef SPR_PROCOV_DATA
+	root = parsenewick(treestring, &tmp, nextname); // assert (tmp == strlen)...
+#else
+	spr_newicktree_init(&parsed, NULL);
+	if (!spr_parse_newick(&parsed, treestring, strlen(treestring), sizeof(struct nodedata), &end, &err)){
+		fprintf(stderr, "brontler: bad tree at offset %zu: %s: \"%.20s\"\n", end, err, treestring + end);
+		return 1;
+	}
+	end += strspn(treestring + end, " \t\n\r\f\v");
+	if (treestring[end]){ // -M is for more than one tree
+		fprintf(stderr, "brontler: bad tree at offset %zu: trailing text after ';': \"%.20s\"\n", end, treestring + end);
+		return 1;
+	}
+	root = parsed.root;
+ have_tree:
+#endif
 	assert( root == spr_findroot(root) );
+	if (printonly){
+		spr_newick_write(stdout, NULL, root, NULL, NULL);
+		putchar('\n');
+#ifndef SPR_PROCOV_DATA
+		spr_newicktree_free(&parsed);
+#endif
+		return 0;
+	}
 	if (debug>=2){
 		puts("starting tree:");
 		if (debug>=5) treeprint(root, stderr);
 		newickprint(root, stdout);
 	}
 
-	if (NULL == (sprtree = spr_init(root, NULL, FALSE))){
+	// mode 0 only looks at one tree's neighbours, and they're all different
+	if (NULL == (sprtree = spr_init(root, NULL, spr_mode == 0 && !dupcheck))){
 		fputs("couldn't init libspr\n", stderr);
 		return 2;
 	}
 	if (debug>=6) spr_treedump(sprtree, stderr);
+	spr_setshard(sprtree, shard, nshards);
+	if (storefile){
+		const char *why;
+		if (nchains > 0){
+			fputs("brontler: -P doesn't work with -c\n", stderr);
+			return 1;
+		}
+		if (!spr_dupstore_open(sprtree, storefile, &why)){
+			fprintf(stderr, "brontler: %s: %s\n", storefile, why);
+			return 2;
+		}
+	}
+	if (ckpt.file && nchains > 0){
+		fputs("brontler: -k doesn't work with -c\n", stderr);
+		return 1;
+	}
+	if (ckpt.resumed){
+		const char *why;
+		if (!ckpt.file){
+			fputs("brontler: -R needs -k file\n", stderr);
+			return 1;
+		}
+		if (access(ckpt.file, F_OK)) // nothing to resume: start from scratch
+			ckpt.resumed = FALSE;
+		else if (!spr_restore(sprtree, ckpt.file, &ckpt.from, sizeof(ckpt.from), &why)){
+			fprintf(stderr, "brontler: %s: %s\n", ckpt.file, why);
+			return 2;
+		}
+		if (ckpt.resumed && rope && sprtree->unspr_dest){
+			fprintf(stderr, "brontler: %s: -r can only resume from between tree iterations\n", ckpt.file);
+			return 1;
+		}
+	}
+
+	if (binfile){
+		if (nchains > 0 || ckpt.resumed){
+			fputs("brontler: -b doesn't work with -c or -R\n", stderr);
+			return 1;
+		}
+		if ((binfd = open(binfile, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0 || !(bin = spr_binwriter_new(binfd, sprtree))){
+			perror("brontler: error starting binary output");
+			return 2;
+		}
+	}
 
 	switch (argc - optind){
-	case 0: retval = !allspr(sprtree, spr_mode, topolimit); break;
+	case 0:
+		if (spr_mode > 0 && nchains > 0)
+			retval = !allspr_chains(sprtree, spr_mode, topolimit, nthreads, nchains, shared);
+		else{
+			if (rope) r = spr_rope_new(sprtree);
+			retval = !allspr(sprtree, spr_mode, topolimit, nthreads, r);
+			if (r) spr_rope_free(r);
+		}
+		break;
 	case 2:
-		src  = spr_treesearchbyname(sprtree, argv[argc-optind]);
-		dest = spr_treesearchbyname(sprtree, argv[argc-optind+1]);
+		src  = spr_treesearchbyname(sprtree, argv[optind]);
+		dest = spr_treesearchbyname(sprtree, argv[optind+1]);
+		if (!src || !dest){
+			fprintf(stderr, "brontler: no node named %s\n", argv[optind + !!src]);
+			retval = 1;
+			break;
+		}
 		if (debug>=2) puts("doing SPR...");
 		tmp = spr(sprtree, src, dest);
 		if (debug>=1){
 			puts(tmp ? "SPR succeeded" : "SPR failed");
 			if (debug>=4) spr_treedump(sprtree, stderr);
 		}
-		newickprint(sprtree->root, stdout);
+		spr_newick_write(stdout, sprtree, sprtree->root, NULL, NULL);
+		putchar('\n');
 		retval = !tmp;
 		break;
 	default:
@@ -319,8 +911,20 @@ int main (int argc, char *argv[])
 		return 1;
 	}
 
+	if (bin){
+		tmp = spr_binwriter_close(bin);
+		if (close(binfd) || !tmp){
+			perror("brontler: writing binary output");
+			retval = 2;
+		}
+	}
+	if (stats) printstats(sprtree);
 	spr_statefree(sprtree);
+#ifdef SPR_PROCOV_DATA
 	spr_treefree(root, TRUE);
+#else
+	spr_newicktree_free(&parsed);
+#endif
 	spr_staticfree();
 	return retval;
 }
@@ -0,0 +1,273 @@
+/* subtree pruning-regrafting (spr) library
+ * Peter Cordes <peter@cordes.ca>, Dalhousie University
+ * license: GPLv2 or later
+ */
+
+/* Checkpoints of a tree's enumeration state, so a long run can be stopped
+ * and carried on later.  File layout, all in host byte order:
+ *  header
+ *  leaf names in clade bit order, each nul-terminated
+ *  left and right child of each node in the start topology, then in the
+ *  current one, as nodelist indices (NONE for leaves)
+ *  the dup set: nrecs of (fp, record), if it's in memory
+ *  the caller's extra bytes
+ * Undoing an SPR can leave children the other way around (see regraft), so
+ * the start topology comes from the move numbering, which has the order it
+ * was numbered in, not from undoing the current SPR.  Restoring both puts
+ * every pointer back where it was, so a resumed run makes exactly the same
+ * moves and writes exactly the same trees as one that was never stopped.
+ * Nodes are identified by nodelist index, and sprnums are too, so the tree
+ * being restored into must have come from the same start tree.
+ * A checkpoint is written to path.tmp and renamed over path, so there's
+ * always one complete checkpoint, even if we're killed while writing. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define SPR_PRIVATE
+#include "spr.h"
+
+#define MAGIC "allsprCK"
+#define VERSION 1
+#define NONE UINT32_MAX
+enum { DUPS_NONE, DUPS_HERE, DUPS_STORE };
+
+struct header{
+	char magic[8];
+	uint32_t version, nodes, taxa, dups;
+	int32_t lastspr, unspr_upper;
+	uint32_t startroot, root, unspr_src, unspr_dest;	// nodelist indices, or NONE
+	uint32_t lcg_a, lcg_c, lcg_m, lcg_state, lcg_startstate, pad;
+	uint64_t names, nrecs, recsize, extra;	// bytes of names, records, bytes per record, bytes of extra
+	uint64_t check;		// of everything before it
+};
+
+static uint64_t checksum( const struct header *h )
+{
+	const unsigned char *b = (const unsigned char *)h;
+	uint64_t c = 0, w;
+	for (size_t i=0 ; i + 8 <= offsetof(struct header, check) ; i += 8){
+		memcpy(&w, b+i, 8);
+		c = mix64(c ^ w);
+	}
+	return c;
+}
+
+static uint32_t indexof( const struct spr_tree *t, const struct spr_node *p ){
+	return p ? (uint32_t)spr_nodeindex(t, p) : NONE; }
+
+// a node's first child comes right after it in the preorder
+static void startkids( const struct spr_tree *t, uint32_t *kids )
+{
+	int i, u;
+	for (i=0 ; i < t->nodes ; i++) kids[2*i] = kids[2*i+1] = NONE;
+	for (i=0 ; i < t->nodes ; i++){
+		if ((u = t->movepar[i]) < 0) continue;
+		kids[2*u + (t->moveorder[t->movepre[u] + 1] != i)] = i;
+	}
+}
+
+// n nodes' worth of kids into tree's nodes
+static void rewire( struct spr_tree *tree, const uint32_t *kids, uint32_t root )
+{
+	struct spr_node *p;
+	for (int i=0 ; i < tree->nodes ; i++){
+		p = tree->nodelist[i];
+		p->left  = kids[2*i] == NONE ? NULL : tree->nodelist[kids[2*i]];
+		p->right = kids[2*i+1] == NONE ? NULL : tree->nodelist[kids[2*i+1]];
+		if (p->left) p->left->parent = p->right->parent = p;
+	}
+	tree->root = tree->nodelist[root];
+	tree->root->parent = NULL;
+	spr_clades_rebuild(tree);
+}
+
+int spr_checkpoint( struct spr_tree *tree, const char *path, const void *extra, size_t extralen )
+{
+	const int n = tree->nodes;
+	struct header h;
+	uint32_t *kids = xmalloc(4 * n * sizeof(*kids));
+	size_t len = strlen(path);
+	char *tmp = xmalloc(len + 5);
+	FILE *f;
+	int i, ok;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, 8);
+	h.version = VERSION;
+	h.nodes = n;
+	h.taxa = tree->taxa;
+	h.lastspr = tree->lastspr;
+	h.unspr_upper = tree->unspr_upper;
+	h.startroot = tree->moveorder[0];
+	h.root = indexof(tree, tree->root);
+	h.unspr_src = indexof(tree, tree->unspr_dest ? tree->unspr_src : NULL);
+	h.unspr_dest = indexof(tree, tree->unspr_dest);
+	h.lcg_a = tree->lcg.a;
+	h.lcg_c = tree->lcg.c;
+	h.lcg_m = tree->lcg.m;
+	h.lcg_state = tree->lcg.state;
+	h.lcg_startstate = tree->lcg.startstate;
+	for (i=0 ; i < tree->taxa ; i++)
+		h.names += strlen(tree->taxonlist[i]->data->name) + 1;
+	h.extra = extralen;
+	if (!tree->dups)
+		h.dups = DUPS_NONE;
+	else if (tree->dups->store){
+		h.dups = DUPS_STORE;
+		if (!spr_dupstore_sync(tree)) goto fail;
+	}else{
+		h.dups = DUPS_HERE;
+		h.nrecs = spr_dupset_count(tree->dups);
+		h.recsize = tree->dups->recsize;
+	}
+	h.check = checksum(&h);
+	startkids(tree, kids);
+	for (i=0 ; i<n ; i++){
+		kids[2*(n+i)] = indexof(tree, tree->nodelist[i]->left);
+		kids[2*(n+i)+1] = indexof(tree, tree->nodelist[i]->right);
+	}
+
+	memcpy(stpcpy(tmp, path), ".tmp", 5);
+	if (!(f = fopen(tmp, "wb"))) goto fail;
+	ok = 1 == fwrite(&h, sizeof(h), 1, f);
+	for (i=0 ; ok && i < tree->taxa ; i++)
+		ok = 0 <= fputs(tree->taxonlist[i]->data->name, f) && EOF != putc('\0', f);
+	ok = ok && 1 == fwrite(kids, 4 * n * sizeof(*kids), 1, f);
+	if (ok && h.dups == DUPS_HERE) ok = spr_dupset_write(tree->dups, f);
+	if (ok && extralen) ok = 1 == fwrite(extra, extralen, 1, f);
+	ok = !fflush(f) && !fsync(fileno(f)) && ok;
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmp, path)){
+		unlink(tmp);
+		goto fail;
+	}
+	free(kids);
+	free(tmp);
+	return TRUE;
+ fail:
+	free(kids);
+	free(tmp);
+	return FALSE;
+}
+
+/* Is kids a binary tree on the same nodes, with the same leaves, rooted at
+ * root?  Every node must be reached exactly once from the root. */
+static int goodtree( const struct spr_tree *tree, const uint32_t *kids, uint32_t root )
+{
+	const uint32_t n = tree->nodes;
+	uint32_t *stack = xmalloc(n * sizeof(*stack)), sp = 0, i, seen = 0;
+	char *reached = xcalloc(n, 1);
+	int ok = root < n;
+
+	if (ok) stack[sp++] = root;
+	while (ok && sp){
+		i = stack[--sp];
+		if (reached[i]++ || ++seen > n) ok = FALSE;
+		else if ((kids[2*i] == NONE) != isleaf(tree->nodelist[i]) || (kids[2*i+1] == NONE) != isleaf(tree->nodelist[i]))
+			ok = FALSE;	// leaves have to stay leaves
+		else if (kids[2*i] != NONE){
+			if (kids[2*i] >= n || kids[2*i+1] >= n) ok = FALSE;
+			else{
+				stack[sp++] = kids[2*i];
+				stack[sp++] = kids[2*i+1];
+			}
+		}
+	}
+	free(stack);
+	free(reached);
+	return ok && seen == n;
+}
+
+int spr_restore( struct spr_tree *tree, const char *path, void *extra, size_t extralen, const char **err )
+{
+	const int n = tree->nodes;
+	struct header h;
+	uint32_t *kids = NULL;
+	char *names = NULL, *name;
+	FILE *f;
+	int i;
+
+	if (!(f = fopen(path, "rb"))){
+		*err = "can't open it";
+		return FALSE;
+	}
+	if (1 != fread(&h, sizeof(h), 1, f) || memcmp(h.magic, MAGIC, 8) ||
+	    h.version != VERSION || h.check != checksum(&h)){
+		*err = "not a checkpoint, or a damaged one";
+		goto fail;
+	}
+	if (h.nodes != (uint32_t)n || h.taxa != (uint32_t)tree->taxa){
+		*err = "it's for a tree of a different size";
+		goto fail;
+	}
+	if (h.extra != extralen){
+		*err = "it's from a different program";
+		goto fail;
+	}
+	if (h.dups != (!tree->dups ? DUPS_NONE : tree->dups->store ? DUPS_STORE : DUPS_HERE) ||
+	    (h.dups == DUPS_HERE && (h.recsize != tree->dups->recsize || tree->dups->refs != 1))){
+		*err = "its duplicate checking doesn't match this tree's";
+		goto fail;
+	}
+
+	names = xmalloc(h.names + 1);
+	kids = xmalloc(4 * n * sizeof(*kids));
+	if (1 != fread(names, h.names, 1, f) || 1 != fread(kids, 4 * n * sizeof(*kids), 1, f)){
+		*err = "it's truncated";
+		goto fail;
+	}
+	names[h.names] = '\0';
+	for (name = names, i=0 ; i < tree->taxa ; i++, name += strlen(name) + 1)
+		if (name >= names + h.names || strcmp(name, tree->taxonlist[i]->data->name)){
+			*err = "it's for a start tree with different taxa";
+			goto fail;
+		}
+	if (!goodtree(tree, kids, h.startroot) || !goodtree(tree, kids + 2*n, h.root) ||
+	    (h.unspr_dest != NONE && (h.unspr_dest >= (uint32_t)n || h.unspr_src >= (uint32_t)n))){
+		*err = "its topology is damaged";
+		goto fail;
+	}
+
+	/* Everything checks out.  Number the start topology's moves, then put
+	 * the iterator and the current topology back. */
+	rewire(tree, kids, h.startroot);
+	spr_apply(tree);
+	tree->lcg.a = h.lcg_a;
+	tree->lcg.c = h.lcg_c;
+	tree->lcg.m = h.lcg_m;
+	tree->lcg.state = h.lcg_state;
+	tree->lcg.startstate = h.lcg_startstate;
+	rewire(tree, kids + 2*n, h.root);
+	tree->lastspr = h.lastspr;
+	if (h.unspr_dest != NONE){
+		tree->unspr_src = tree->nodelist[h.unspr_src];
+		tree->unspr_dest = tree->nodelist[h.unspr_dest];
+		tree->unspr_upper = h.unspr_upper;
+	}
+
+	if (h.dups == DUPS_HERE){
+		spr_dupset_clear(tree);
+		if (!spr_dupset_read(tree, f, h.nrecs)){
+			*err = "it's truncated, in the dup set";
+			goto fail;
+		}
+	}
+	if (extralen && 1 != fread(extra, extralen, 1, f)){
+		*err = "it's truncated";
+		goto fail;
+	}
+	fclose(f);
+	free(names);
+	free(kids);
+	return TRUE;
+ fail:
+	fclose(f);
+	free(names);
+	free(kids);
+	return FALSE;
+}
@@ -7,27 +7,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#include <sched.h>
 
 #define SPR_PRIVATE
 #include "spr.h"
 
-// return neighbours (not necessarily leaves).
-// only nodes near the root have two
-static inline struct spr_node *neighbour1( struct spr_node *p ){
-	if (isroot(p->parent))
-		return (sibling(p))->left;
-	else return sibling(p);
-}
-static inline struct spr_node *neighbour2( struct spr_node *p ){
-	if (isroot(p->parent))
-		return (sibling(p))->right;
-	else if (isroot(p->parent->parent)){
-		return sibling(p->parent);
-	}else
-		return NULL;
-}
-
 void checktree( const struct spr_node *p )
 {
 	if(p){
@@ -38,128 +24,793 @@ void checktree( const struct spr_node *p )
 }
 
 
-/* compare two trees.  return TRUE if they have the same topology,
+/* The dup check works on topologies as structures of arrays of node numbers,
+ * instead of struct spr_node: taxa are nodes 0..taxa-1 (numbered by the set),
+ * internal nodes follow in postorder, so the root is nodes-1, and it is its
+ * own parent.  On x86-64 that's 12 bytes a node instead of 32, and a stored
+ * topology is just the parent array.  taxon[] is which taxon a leaf is.
+ * They all point into tree->dupwork. */
+#define NONE UINT32_MAX
+struct topo{
+	uint32_t *parent, *left, *right, *taxon;
+};
+#define TOPO_ARRAYS 4
+#define DUPWORK_WORDS(n) ((3*TOPO_ARRAYS + 2) * (size_t)(n))  // A, copy of A, B, where, stack
+
+static inline struct topo topo_at( uint32_t *w, int n )
+{
+	struct topo t = { w, w + n, w + 2*n, w + 3*n };
+	return t;
+}
+static inline void topo_copy( struct topo *dst, const struct topo *src, int n )
+{
+	memcpy(dst->parent, src->parent, TOPO_ARRAYS * n * sizeof(uint32_t)); // they're contiguous
+}
+
+#define isleaf_t(t, i)	((t)->left[i] == NONE)
+#define isroot_t(t, i)	((t)->parent[i] == (i))
+static inline uint32_t sibling_t( const struct topo *t, uint32_t i ){
+	uint32_t p = t->parent[i];
+	return t->left[p] == i ? t->right[p] : t->left[p];
+}
+
+/* the unrooted neighbours of p that could be leaves.  Only nodes near the
+ * root have two.  NONE if there isn't one */
+static inline uint32_t neighbour1( const struct topo *t, uint32_t p ){
+	if (isroot_t(t, t->parent[p]))
+		return t->left[sibling_t(t, p)];
+	else return sibling_t(t, p);
+}
+static inline uint32_t neighbour2( const struct topo *t, uint32_t p ){
+	if (isroot_t(t, t->parent[p]))
+		return t->right[sibling_t(t, p)];
+	else if (isroot_t(t, t->parent[t->parent[p]]))
+		return sibling_t(t, t->parent[p]);
+	else
+		return NONE;
+}
+
+/* compare two topologies.  return TRUE if they're the same,
  * ignoring the position of the root. i.e. as if they represent unrooted trees.
- * Actually operate on copies of the trees, because we destructively reduce
- * the two trees until we find a difference, or get down to three nodes.
- * (there is only possible unrooted topology for three nodes).
+ * Destructive: we reduce the two trees until we find a difference, or get
+ * down to three taxa (there is only possible unrooted topology for three).
  *
  * A cherry is an internal node with two leaf nodes as children.  If a cherry
  * exists in tree A, it must exist in tree B if they are topologically the same.
  * Our algorithm is: find a cherry in A, find it in B, and then replace it
- * with just one of its constituent leaves.
- *
- * As an optimization, we operate on trees where all the node structs are known to be
- * in two contiguous arrays.  Instead of a spr_searchybypointer, we linearly search the
- * array.  Instead of free() we set ->data = NULL (so searches don't find deleted nodes).
+ * with just one of its constituent leaves.  where[] maps a taxon to its
+ * leaf in B, so finding it is O(1), not a linear search.
  */
-static int sametopo( struct spr_node *array1, struct spr_node *array2, size_t asize, int ntaxa )
+static int sametopo( struct spr_tree *tree, struct topo *A, struct topo *B, uint32_t *where )
 {
-	struct spr_node *A, *B, *cherryA, *cherryB, *p, *q;
-	int retval = FALSE;
+	const int nodes = tree->nodes;
+	int ntaxa = tree->taxa;
+	uint32_t cA, cB, p, q, r, x, y, del;
 
-	A = spr_findroot(array1);
-	B = spr_findroot(array2);
+	SPR_COUNT(tree, dup_compares);
 
+	for (x=0 ; x < (uint32_t)ntaxa ; x++) where[x] = x;
 	while (ntaxa>3){
-		cherryA = A;
+		cA = nodes-1;  // A keeps its root
 		while(42){ // find a cherry in A
-			if (isleaf(cherryA->left)){
-				if (isleaf(cherryA->right)) break; // found
-				else cherryA = cherryA->right;
-			}else cherryA = cherryA->left;
+			if (isleaf_t(A, A->left[cA])){
+				if (isleaf_t(A, A->right[cA])) break; // found
+				else cA = A->right[cA];
+			}else cA = A->left[cA];
 		}
+		x = A->taxon[A->left[cA]];
+		y = A->taxon[A->right[cA]];
 
-		//p = spr_searchbypointer(B, cherryA->left->data);
-		for( p=array2 ; p<array2+asize && p->data!=cherryA->left->data ; p++ );
-		// if (!(p && p < array2+asize)) *(int *)NULL = 1; // segfault please
-		assert( p && p < array2+asize /* trees must share a set of data pointers */ );
-		cherryB = p->parent; // only a potential cherry so far
+		p = where[x];
+		cB = B->parent[p]; // only a potential cherry so far
 
 		// find the cherry in B and reduce both trees
-		if ((q=neighbour1(p))->data == cherryA->right->data ||
-		    ((q=neighbour2(p)) && q->data == cherryA->right->data)){
-			// if the cherry in B spans the root, always delete the root and
-			// the leaf attached to it, with the remaining tree needing no modification
-			if (isroot(p->parent) || isroot(q->parent)){
-			// point q at the leaf child of the root, which we are going to delete
-				if (isroot(p->parent)){
-					q = p;
-					cherryA->data = cherryA->right->data;
-				}else
-					cherryA->data = cherryA->left->data;
-				B = sibling(q);
-				B->parent = NULL;
-				q->parent->data = q->data = NULL;
-				//free(q->parent); free(q);
+		if (((q=neighbour1(B, p)) != NONE && isleaf_t(B, q) && B->taxon[q] == y) ||
+		    ((q=neighbour2(B, p)) != NONE && isleaf_t(B, q) && B->taxon[q] == y)){
+			A->left[cA] = A->right[cA] = NONE;
+			if (isroot_t(B, cB) || isroot_t(B, B->parent[q])){
+				// if the cherry in B spans the root, always delete the root and
+				// the leaf attached to it, with the remaining tree needing no modification
+				if (isroot_t(B, cB)){
+					del = p;
+					A->taxon[cA] = y;
+				}else{
+					del = q;
+					A->taxon[cA] = x;
+				}
+				r = sibling_t(B, del);
+				B->parent[r] = r;
 			}else{
 				// the simple case not involving the root.
-				cherryB->data = q->data;
-				//free(cherryB->left); free(cherryB->right);
-				cherryB->left->data = cherryB->right->data = NULL;
-				cherryB->left = cherryB->right = NULL;
-				cherryA->data = cherryA->right->data;
+				B->left[cB] = B->right[cB] = NONE;
+				B->taxon[cB] = y;
+				where[y] = cB;
+				A->taxon[cA] = y;
 			}
-			// make the matching change in tree A
-			//free(cherryA->left); free(cherryA->right);
-			// cherryA->left->data = cherryA->right->data = NULL; // not needed
-			cherryA->left = cherryA->right = NULL;
 		}else
-			goto out_FALSE;
+			return FALSE;
 
+		SPR_COUNT(tree, dup_cherries);
 		ntaxa--;
 	}
+	return TRUE;
+}
+
+/************ topology fingerprints and the dup hash set ************/
+
+/* map a ->data pointer to a small integer taxon number.  Numbers are handed
+ * out the first time a taxon is seen, so every tree in the set shares them. */
+static int taxon_id( struct spr_dupset *set, const void *data )
+{
+	size_t i, mask = set->taxsize-1;
+	for (i = mix64((size_t)data) & mask ; set->taxa[i].data ; i = (i+1) & mask)
+		if (set->taxa[i].data == data) return set->taxa[i].id;
+
+	if (2*(set->ntaxa+1) > set->taxsize){ // grow and rehash
+		struct spr_taxon *old = set->taxa;
+		int j, oldsize = set->taxsize;
+		set->taxsize *= 2;
+		set->taxa = xcalloc(set->taxsize, sizeof(*set->taxa));
+		set->taxdata = xrealloc(set->taxdata, set->taxsize * sizeof(*set->taxdata));
+		for (j=0 ; j<oldsize ; j++){
+			if (!old[j].data) continue;
+			mask = set->taxsize-1;
+			for (i = mix64((size_t)old[j].data) & mask ; set->taxa[i].data ; i = (i+1) & mask);
+			set->taxa[i] = old[j];
+		}
+		free(old);
+		return taxon_id(set, data);
+	}
+	set->taxa[i].data = data;
+	set->taxdata[set->ntaxa] = data;
+	return set->taxa[i].id = set->ntaxa++;
+}
+
+/* Build tree->dupwork's A from the tree at root, in one walk with parent
+ * pointers and a stack of finished subtrees, and hash its unrooted topology.
+ * Each clade gets the XOR of random keys for its taxa, so the two sides of a
+ * split hash to h and total^h.  Taking the smaller of those makes a split's
+ * hash independent of which side the root is on, and summing over the splits
+ * makes it independent of traversal order.  Each internal edge is counted
+ * once: the root's two children are the same unrooted edge, so ->right is
+ * skipped, and a root child whose sibling is a leaf is a trivial split. */
+static unsigned long long topo_build( struct spr_tree *tree, const struct spr_node *root )
+{
+	const int n = tree->nodes;
+	struct topo A = topo_at(tree->dupwork, n);
+	uint32_t *stack = tree->dupwork + (3*TOPO_ARRAYS + 1) * (size_t)n;
+	uint32_t id, l, r, sp = 0, nextid = tree->taxa;
+	unsigned long long *h = tree->duphash, total, c, fp = 0;
+	const struct spr_node *p = root, *prev = NULL;
+
+	for (;;){
+		if (prev == (p == root ? NULL : p->parent)){ // first time to the node
+			if (p->left){
+				prev = p; p = p->left;
+				continue;
+			}
+			id = taxon_id(tree->dups, p->data);
+			A.left[id] = A.right[id] = NONE;
+			A.taxon[id] = id;
+			h[id] = mix64(1 + id);
+			stack[sp++] = id;
+		}else if (prev == p->left){
+			prev = p; p = p->right;
+			continue;
+		}else{ // both subtrees done
+			id = nextid++;
+			r = stack[--sp];
+			l = stack[--sp];
+			A.left[id] = l;
+			A.right[id] = r;
+			A.parent[l] = A.parent[r] = id;
+			A.taxon[id] = NONE;
+			h[id] = h[l] ^ h[r];
+			stack[sp++] = id;
+		}
+		if (p == root) break;
+		prev = p; p = p->parent;
+	}
+	assert( nextid == (uint32_t)n /* tree must have tree->nodes nodes */ );
+	A.parent[n-1] = n-1;
+	total = h[n-1];
+
+	r = A.right[n-1];
+	for (id = tree->taxa ; id < (uint32_t)n-1 ; id++){
+		if (id == r || (id == A.left[n-1] && isleaf_t(&A, r)))
+			continue;
+		c = h[id];
+		if ((total ^ c) < c) c ^= total;
+		fp += mix64(c);
+	}
+	return tree->dupfp = fp ? fp : 1;  // 0 marks an empty slot
+}
+
+/* A stored topology is A's parent array.  uint16_t for trees with < 65535
+ * nodes, so those get narrowed on the way in and out. */
+#define PARENTS_WIDE(set) ((set)->nodes >= 0xffff)
+static void *encode_into( struct spr_tree *tree, void *rec )
+{
+	const uint32_t *parent = tree->dupwork;
+	const int n = tree->nodes;
+	int i;
+
+	if (PARENTS_WIDE(tree->dups))
+		memcpy(rec, parent, n * sizeof(*parent));
+	else
+		for (i=0 ; i<n ; i++) ((uint16_t *)rec)[i] = parent[i];
+	return rec;
+}
+static inline void *encode_topo( struct spr_tree *tree ){
+	return encode_into(tree, spr_arena_alloc(&tree->duprecs, tree->dups->recsize)); }
+
+// rebuild the child arrays from a stored parent array
+static void expand_topo( const struct spr_dupset *set, const void *rec, struct topo *B )
+{
+	const int n = set->nodes;
+	uint32_t i, par;
+
+	memset(B->left, 0xff, 2 * n * sizeof(uint32_t)); // left and right = NONE
+	for (i=0 ; i<n ; i++){
+		par = B->parent[i] = PARENTS_WIDE(set) ? ((const uint32_t *)rec)[i] : ((const uint16_t *)rec)[i];
+		B->taxon[i] = i < (uint32_t)set->ntaxa ? i : NONE;
+		if (par == i) continue;
+		if (B->left[par] == NONE) B->left[par] = i;
+		else B->right[par] = i;
+	}
+}
 
-	retval = TRUE;
- out_FALSE:
-	//spr_treefree(A, FALSE);
-	//spr_treefree(B, FALSE);
-	return retval;
+/* and to struct spr_node, with the taxa's ->data pointers, for spr_find_dup */
+static struct spr_node *expand_nodes( const struct spr_dupset *set, const struct topo *B, struct spr_node *nodes )
+{
+	const int n = set->nodes;
+	int i;
+	for (i=0 ; i<n ; i++){
+		struct spr_node *p = nodes + i;
+		p->data = (i < set->ntaxa) ? (void *)set->taxdata[i] : NULL;
+		p->parent = isroot_t(B, i) ? NULL : nodes + B->parent[i];
+		p->left = isleaf_t(B, i) ? NULL : nodes + B->left[i];
+		p->right = isleaf_t(B, i) ? NULL : nodes + B->right[i];
+	}
+	return nodes + n-1;
 }
 
-/* drive the sametopo routine.
- * spr_copytoarray is slow compared to memcpy, so the dup list is stored as
- * trees in arrays that can be used in place.  memcpy is used to save and restore
- * the tree.  A similar optimization is used for the tree we're testing against
- * the dup list, but it's the same every time, so there's less copying in the loop.
+/* A set is shared by trees in different threads without locks: a new entry
+ * claims its slot with a CAS on fp, and then publishes its record.  Two threads
+ * adding the same topology probe the same slots, so the loser sees the
+ * winner's fp (and waits for its record) before it can reach an empty slot.
  *
- * Being able to use the dup list in place, with no calls to spr_copytoarray()
- * in the inner loop, is a huge win for execution speed (~double speed on 16 taxa).
- * A more space-efficient dup list could be used, maybe with tree nodes as int or even
- * short int array indices.  expanding this to a struct spr_node array could be done with
- * a linear pass, not a recursive function like spr_copytoarray().
+ * A thread is "in" a shard while it's using the shard's table.  Growing a
+ * table waits until nobody is in, and holds new arrivals at the door.
+ * Reserving a slot (count) before claiming one keeps every table at most half
+ * full, so a probe always finds an empty slot. */
+#define shardof(set, fp) (&(set)->shards[(fp) >> (64 - SPR_DUPSHARDBITS)])
+
+static inline void spinwait( int *spins ){ if (++*spins > 1000) sched_yield(); }
+
+static void enter( struct spr_dupshard *s )
+{
+	int spins = 0;
+	for (;;){
+		__sync_fetch_and_add(&s->active, 1);
+		if (!__atomic_load_n(&s->resizing, __ATOMIC_SEQ_CST)) return;
+		__sync_fetch_and_sub(&s->active, 1);
+		while (__atomic_load_n(&s->resizing, __ATOMIC_ACQUIRE)) spinwait(&spins);
+	}
+}
+static inline void leave( struct spr_dupshard *s ){ __sync_fetch_and_sub(&s->active, 1); }
+
+/* Blocked Bloom filter: each fp sets k bits in one 64-byte block, so a check
+ * is one cache line, like a table probe, but at 10 bits per topology the
+ * filter is 1/25th the size of a table (2 slots of 16 bytes each), so much
+ * more of it stays in cache.  The block comes from a
+ * remix of fp; the bit numbers are 9-bit fields from the low end of it.
+ * Each filter is sized for the most topologies its shard's table can hold,
+ * and rebuilt from the table when the table grows. */
+#define BLOOMWORDS 8
+static inline int bloom_k( int bits ){ // ~ln(2) bits per bit per key
+	int k = (bits*7 + 5) / 10;
+	return k < 1 ? 1 : k > 6 ? 6 : k;
+}
+static inline unsigned long long *bloom_block( const struct spr_dupshard *s, unsigned long long fp ){
+	return s->bloom + BLOOMWORDS * (mix64(fp) & (s->bloomblocks-1)); }
+
+static void bloom_set( struct spr_dupshard *s, int k, unsigned long long fp )
+{
+	unsigned long long *b = bloom_block(s, fp);
+	for (int i=0 ; i<k ; i++, fp >>= 9)
+		__sync_fetch_and_or(&b[(fp >> 6) & 7], 1ULL << (fp & 63));
+}
+
+static int bloom_maybe( const struct spr_dupshard *s, int k, unsigned long long fp )
+{
+	const unsigned long long *b = bloom_block(s, fp);
+	for (int i=0 ; i<k ; i++, fp >>= 9)
+		if (!(__atomic_load_n(&b[(fp >> 6) & 7], __ATOMIC_RELAXED) & (1ULL << (fp & 63))))
+			return FALSE;
+	return TRUE;
+}
+
+// only while nobody else is in the shard
+static void bloom_build( struct spr_dupshard *s, int bits )
+{
+	size_t want = (s->size/2 * bits + 511) / 512;
+	free(s->bloom);
+	s->bloom = NULL;
+	s->bloomblocks = 0;
+	if (!bits) return;
+	for (s->bloomblocks = 1 ; s->bloomblocks < want ; s->bloomblocks *= 2);
+	if (posix_memalign((void **)&s->bloom, 64, s->bloomblocks * BLOOMWORDS * sizeof(*s->bloom))){
+		perror("allspr: allocating dup set filter");
+		exit(2);
+	}
+	memset(s->bloom, 0, s->bloomblocks * BLOOMWORDS * sizeof(*s->bloom));
+	for (size_t i=0 ; i < s->size ; i++)
+		if (s->table[i].fp) bloom_set(s, bloom_k(bits), s->table[i].fp);
+}
+
+void spr_dupset_bloom( struct spr_dupset *set, int bits )
+{
+	set->bloombits = bits > 0 ? bits : 0;
+	for (int i=0 ; i < (1 << SPR_DUPSHARDBITS) ; i++)
+		bloom_build(&set->shards[i], set->bloombits);
+}
+
+/* call from inside the shard.  Returns outside it, with the table grown,
+ * by this thread or another one. */
+static void grow( const struct spr_dupset *set, struct spr_dupshard *s )
+{
+	struct spr_dupent *old = s->table, *new;
+	size_t i, j, mask, oldsize = s->size;
+	int spins = 0;
+
+	if (!__sync_bool_compare_and_swap(&s->resizing, 0, 1)){
+		leave(s);  // someone else is growing it
+		return;
+	}
+	leave(s);
+	while (__atomic_load_n(&s->active, __ATOMIC_SEQ_CST)) spinwait(&spins);
+
+	// nobody is in, so every claimed slot has its record
+	new = xcalloc(2*oldsize, sizeof(*new));
+	mask = 2*oldsize - 1;
+	for (j=0 ; j<oldsize ; j++){
+		if (!old[j].fp) continue;
+		for (i = old[j].fp & mask ; new[i].fp ; i = (i+1) & mask);
+		new[i] = old[j];
+	}
+	s->table = new;
+	s->size = 2*oldsize;
+	free(old);
+	if (s->bloom) bloom_build(s, set->bloombits);
+	__atomic_store_n(&s->resizing, 0, __ATOMIC_RELEASE);
+}
+
+/* look for a tree with the same fingerprint and topology as dupwork's A, and
+ * if add is set and there isn't one, add A.  Returns the matching record, or
+ * NULL.  Lookups without add trust the shard's Bloom filter, if it has one,
+ * when it says no.  Candidates are expanded from the compact format into B.
+ * sametopo() is destructive, so it gets a copy of A.
+ * That only happens on a fingerprint match, which is almost always a real dup. */
+static void *tablelookup( struct spr_tree *tree, unsigned long long fp, int add )
+{
+	struct spr_dupset *set = tree->dups;
+	struct spr_dupshard *s = shardof(set, fp);
+	const int n = tree->nodes;
+	struct topo A = topo_at(tree->dupwork, n),
+		W = topo_at(tree->dupwork + TOPO_ARRAYS*(size_t)n, n),
+		B = topo_at(tree->dupwork + 2*TOPO_ARRAYS*(size_t)n, n);
+	uint32_t *where = tree->dupwork + 3*TOPO_ARRAYS*(size_t)n;
+	struct spr_dupent *table;
+	size_t i, mask;
+	unsigned long long slotfp;
+	void *rec, *mine = NULL;
+	int reserved = FALSE, filtered = FALSE, spins;
+
+retry:
+	enter(s);
+	table = s->table;  // can't change while we're in
+	mask = s->size-1;
+	if (!add && s->bloom){
+		rec = NULL;
+		if (!bloom_maybe(s, bloom_k(set->bloombits), fp)){
+			SPR_COUNT(tree, bloom_negatives);
+			goto out;
+		}
+		filtered = TRUE;
+	}
+	for (i = fp & mask ; ; i = (i+1) & mask){
+		slotfp = __atomic_load_n(&table[i].fp, __ATOMIC_ACQUIRE);
+		if (!slotfp){
+			rec = NULL;
+			if (!add) break;
+			if (!reserved){
+				if (2*__sync_add_and_fetch(&s->count, 1) > s->size){
+					__sync_fetch_and_sub(&s->count, 1);
+					grow(set, s);
+					goto retry;
+				}
+				reserved = TRUE;
+			}
+			if (!mine) mine = encode_topo(tree);
+			if (__sync_bool_compare_and_swap(&table[i].fp, 0, fp)){
+				__atomic_store_n(&table[i].rec, mine, __ATOMIC_RELEASE);
+				if (s->bloom) bloom_set(s, bloom_k(set->bloombits), fp);
+				reserved = FALSE;
+				break;
+			}
+			slotfp = __atomic_load_n(&table[i].fp, __ATOMIC_ACQUIRE); // lost the race for it
+		}
+		if (slotfp != fp) continue;
+
+		spins = 0;  // claimed, maybe not published yet
+		while (!(rec = __atomic_load_n(&table[i].rec, __ATOMIC_ACQUIRE)))
+			spinwait(&spins);
+		expand_topo(set, rec, &B);
+		topo_copy(&W, &A, n);
+		if (sametopo(tree, &W, &B, where)) break;
+	}
+	if (filtered && !rec) SPR_COUNT(tree, bloom_falsepos);
+ out:
+	if (reserved) __sync_fetch_and_sub(&s->count, 1);
+	leave(s);
+	if (rec && mine) // another thread added it first.  mine was the arena's last allocation
+		tree->duprecs.next = mine;
+	return rec;
+}
+
+// the same, for a set in a file.  One lookup at a time, with the store's lock
+static void *storelookup( struct spr_tree *tree, unsigned long long fp, int add )
+{
+	struct spr_dupstore *st = tree->dups->store;
+	struct spr_dupstore_cursor c = { 0, FALSE };
+	const int n = tree->nodes;
+	struct topo A = topo_at(tree->dupwork, n),
+		W = topo_at(tree->dupwork + TOPO_ARRAYS*(size_t)n, n),
+		B = topo_at(tree->dupwork + 2*TOPO_ARRAYS*(size_t)n, n);
+	uint32_t *where = tree->dupwork + 3*TOPO_ARRAYS*(size_t)n;
+	const void *rec;
+
+	spr_dupstore_lock(st);
+	while ((rec = spr_dupstore_next(st, fp, &c))){
+		expand_topo(tree->dups, rec, &B);
+		topo_copy(&W, &A, n);
+		if (sametopo(tree, &W, &B, where)) break;
+	}
+	if (!rec && add)
+		spr_dupstore_insert(st, fp, encode_into(tree, spr_dupstore_alloc(st)));
+	spr_dupstore_unlock(st);
+	return (void *)rec;
+}
+
+static void *dupset_lookup( struct spr_tree *tree, unsigned long long fp, int add )
+{
+	void *rec = tree->dups->store ? storelookup(tree, fp, add) : tablelookup(tree, fp, add);
+	SPR_COUNT(tree, dup_calls);
+	if (rec) SPR_COUNT(tree, dup_hits);
+	else SPR_COUNT(tree, dup_misses);
+	return rec;
+}
+
+/* A hash lookup replaces the old walk over every stored tree, and stored trees
+ * are parent arrays instead of struct spr_node arrays.  With 64bit pointers,
+ * a 50taxon (97node) tree takes 194 bytes, where a node array took ~3kB.
+ * Expanding a record is a linear pass, and only happens on a fingerprint match.
  *
- * This is all academic when liballspr is being used by a likelihood optimizing program
- * that takes much more time to evaluate a tree than it does to dup check it, and which
- * can't practically be used on very large (> 1000 nodes?) trees.
- * With 64bit pointers, a dup list tree array takes ~3kB for a 50taxon (97node) tree.
+ * Returns a pointer to the root of an expanded copy of the dup, in scratch
+ * space that is only valid until the next dup check on this tree.
  */
 struct spr_node *spr_find_dup( struct spr_tree *tree, struct spr_node *root ){
-	struct spr_duplist *p = tree->dups;
-	struct spr_node *A, *B, *saveA, *saveB;
-	int n = tree->nodes, tmp;
+	const int n = tree->nodes;
+	struct topo B = topo_at(tree->dupwork + 2*TOPO_ARRAYS*(size_t)n, n);
+	struct spr_node *dup = NULL;
+	void *rec;
+	SPR_TIMER(t0);
 
 	assert( tree->nodes == spr_countnodes(root) );
-	A = xmalloc(n*sizeof(*A));
-	tmp = spr_copytoarray(A, root);
-	assert( n == tmp /* copytoarray had better copy the right number of nodes */ );
+	rec = dupset_lookup(tree, topo_build(tree, root), FALSE);
+	if (rec){
+		// records are never moved or modified once they're in the set
+		expand_topo(tree->dups, rec, &B);
+		dup = expand_nodes(tree->dups, &B, tree->dupnodes);
+	}
+	SPR_TIMED(tree, find_dup, t0);
+	return dup;
+}
+
+/* All the taxa are numbered up front, in clade bit order, so looking them up
+ * doesn't modify the set.  Every tree that shares it must have the same taxa
+ * (i.e. the same ->data pointers on its leaves). */
+struct spr_dupset *spr_dupset_new( const struct spr_tree *tree )
+{
+	struct spr_dupset *set;
+	if (posix_memalign((void **)&set, 64, sizeof(*set))){
+		perror("allspr: allocating dup set");
+		exit(2);
+	}
+	for (int i=0 ; i < (1 << SPR_DUPSHARDBITS) ; i++){
+		struct spr_dupshard *s = &set->shards[i];
+		s->size = 16;
+		s->table = xcalloc(s->size, sizeof(*s->table));
+		s->count = 0;
+		s->active = s->resizing = 0;
+		s->bloom = NULL;
+		s->bloomblocks = 0;
+	}
+	set->bloombits = 0;
+	set->store = NULL;
+	for (set->taxsize = 16 ; set->taxsize < 2*tree->taxa ; set->taxsize *= 2);
+	set->ntaxa = 0;
+	set->taxa = xcalloc(set->taxsize, sizeof(*set->taxa));
+	set->taxdata = xmalloc(set->taxsize * sizeof(*set->taxdata));
+	for (int i=0 ; i < tree->taxa ; i++)
+		taxon_id(set, tree->taxonlist[i]->data);
+	set->nodes = tree->nodes;
+	set->recsize = tree->nodes * (PARENTS_WIDE(set) ? sizeof(uint32_t) : sizeof(uint16_t));
+	spr_arena_init(&set->recs, 0);
+	set->refs = 0;
+	return set;
+}
+
+int spr_dupset_attach( struct spr_tree *tree, struct spr_dupset *set )
+{
+	if (tree->nodes != set->nodes || tree->taxa != set->ntaxa)
+		return FALSE;
+	for (int i=0 ; i < tree->taxa ; i++){ // same taxa?
+		const void *data = tree->taxonlist[i]->data;
+		size_t j, mask = set->taxsize-1;
+		for (j = mix64((size_t)data) & mask ; set->taxa[j].data && set->taxa[j].data != data ; j = (j+1) & mask);
+		if (!set->taxa[j].data) return FALSE;
+	}
+	if (tree->dups) spr_dupset_detach(tree);
+	__sync_fetch_and_add(&set->refs, 1);
+	tree->dups = set;
+	tree->dupwork = xmalloc(DUPWORK_WORDS(tree->nodes) * sizeof(*tree->dupwork));
+	tree->duphash = xmalloc(tree->nodes * sizeof(*tree->duphash));
+	tree->dupnodes = xmalloc(tree->nodes * sizeof(*tree->dupnodes));
+	spr_arena_init(&tree->duprecs, max((size_t)64*1024, 64*set->recsize));
+	return TRUE;
+}
+
+void spr_dupset_detach( struct spr_tree *tree )
+{
+	struct spr_dupset *set = tree->dups;
+	if (!set) return;
+	spr_arena_handoff(&tree->duprecs, &set->recs); // other trees may still be using them
+	if (0 == __sync_sub_and_fetch(&set->refs, 1)){
+		spr_arena_free(&set->recs);
+		for (int i=0 ; i < (1 << SPR_DUPSHARDBITS) ; i++){
+			free(set->shards[i].table);
+			free(set->shards[i].bloom);
+		}
+		if (set->store) spr_dupstore_close(set->store);
+		free(set->taxa);
+		free(set->taxdata);
+		free(set);
+	}
+	free(tree->dupwork);
+	free(tree->duphash);
+	free(tree->dupnodes);
+	tree->dups = NULL;
+	tree->dupwork = NULL;
+	tree->duphash = NULL;
+	tree->dupnodes = NULL;
+}
+
+int spr_dupset_clear( struct spr_tree *tree )
+{
+	struct spr_dupset *set = tree->dups;
+	int i;
+	if (set->refs != 1 || set->store) return FALSE;
+
+	for (i=0 ; i < (1 << SPR_DUPSHARDBITS) ; i++){
+		struct spr_dupshard *s = &set->shards[i];
+		memset(s->table, 0, s->size * sizeof(*s->table));
+		if (s->bloom) memset(s->bloom, 0, s->bloomblocks * BLOOMWORDS * sizeof(*s->bloom));
+		s->count = 0;
+	}
+	spr_arena_reset(&tree->duprecs);
+	spr_arena_free(&set->recs);  // only has anything after a detach
+
+	if (tree->nodes > set->nodes){
+		tree->dupwork = xrealloc(tree->dupwork, DUPWORK_WORDS(tree->nodes) * sizeof(*tree->dupwork));
+		tree->duphash = xrealloc(tree->duphash, tree->nodes * sizeof(*tree->duphash));
+		tree->dupnodes = xrealloc(tree->dupnodes, tree->nodes * sizeof(*tree->dupnodes));
+	}
+	if (tree->nodes != set->nodes){
+		set->nodes = tree->nodes;
+		set->recsize = tree->nodes * (PARENTS_WIDE(set) ? sizeof(uint32_t) : sizeof(uint16_t));
+		spr_arena_free(&tree->duprecs);
+		spr_arena_init(&tree->duprecs, max((size_t)64*1024, 64*set->recsize));
+	}
+
+	// new leaves, new ->data pointers
+	if (set->taxsize < 2*tree->taxa){
+		for ( ; set->taxsize < 2*tree->taxa ; set->taxsize *= 2);
+		free(set->taxa);
+		set->taxa = xmalloc(set->taxsize * sizeof(*set->taxa));
+		set->taxdata = xrealloc(set->taxdata, set->taxsize * sizeof(*set->taxdata));
+	}
+	memset(set->taxa, 0, set->taxsize * sizeof(*set->taxa));
+	set->ntaxa = 0;
+	for (i=0 ; i < tree->taxa ; i++)
+		taxon_id(set, tree->taxonlist[i]->data);
+	return TRUE;
+}
+
+/* The store numbers taxa by name, so the set's numbers change to match.
+ * Stored topologies use them, so the in-memory tables are emptied. */
+int spr_dupstore_open( struct spr_tree *tree, const char *path, const char **err )
+{
+	struct spr_dupset *set;
+	struct spr_dupstore *st;
+	const char **names;
+	size_t j, mask;
+	int i, *ids;
+
+	if (!tree->dups) spr_dupset_init(tree);
+	set = tree->dups;
+	if (set->refs != 1 || set->store){
+		*err = "the dup set is shared, or already has a store";
+		return FALSE;
+	}
+	names = xmalloc(tree->taxa * sizeof(*names));
+	ids = xmalloc(tree->taxa * sizeof(*ids));
+	for (i=0 ; i < tree->taxa ; i++){ // in set order, so a new store keeps the numbers
+		names[i] = ((const struct spr_nodename *)set->taxdata[i])->name;
+		for (int k=0 ; k<i ; k++)
+			if (!strcmp(names[k], names[i])){
+				*err = "taxon names aren't unique";
+				goto fail;
+			}
+	}
+	if (!(st = spr_dupstore_file(path, TRUE, tree->nodes, tree->taxa, names, set->recsize, err)))
+		goto fail;
+	for (i=0 ; i < tree->taxa ; i++)
+		if ((ids[i] = spr_dupstore_taxon(st, names[i])) < 0){
+			*err = "it has different taxa";
+			spr_dupstore_close(st);
+			goto fail;
+		}
+
+	mask = set->taxsize-1;
+	for (j=0 ; j <= mask ; j++)
+		if (set->taxa[j].data) set->taxa[j].id = ids[set->taxa[j].id];
+	for (j=0 ; j <= mask ; j++)
+		if (set->taxa[j].data) set->taxdata[set->taxa[j].id] = set->taxa[j].data;
+	for (i=0 ; i < (1 << SPR_DUPSHARDBITS) ; i++){
+		struct spr_dupshard *s = &set->shards[i];
+		memset(s->table, 0, s->size * sizeof(*s->table));
+		if (s->bloom) memset(s->bloom, 0, s->bloomblocks * BLOOMWORDS * sizeof(*s->bloom));
+		s->count = 0;
+	}
+	spr_arena_reset(&tree->duprecs);
+	set->store = st;
+	spr_add_dup(tree, tree->root);
+	free(names);
+	free(ids);
+	return TRUE;
+ fail:
+	free(names);
+	free(ids);
+	return FALSE;
+}
 
-	saveA = xmalloc(n*sizeof(*A));
-	memcpy(saveA, A, n*sizeof(*A));
-	saveB = xmalloc(n*sizeof(*A));
-	for (p=tree->dups ; p ; p=p->next){
-		B = p->tree;
-		// the dup list can be used in place if we make a backup
-		memcpy(saveB, B, n*sizeof(*A));
-		tmp = sametopo(A, B, n, tree->taxa);
-		memcpy(B, saveB, n*sizeof(*A));
-		if (tmp) break;
-		memcpy(A, saveA, n*sizeof(*A));
+/* Input records number taxa the input store's way, so the leaf entries of
+ * their parent arrays are permuted into the set's numbering first.  Internal
+ * nodes and the root keep their numbers.  Each one then goes through
+ * spr_add_dup() as a tree of dupnodes, which also makes the caller's copy. */
+long spr_dupset_merge( struct spr_tree *tree, const char *path,
+	void (*fn)(const struct spr_node *root, void *arg), void *arg, const char **err )
+{
+	struct spr_dupset *set;
+	struct spr_dupstore *st;
+	const int n = tree->nodes;
+	struct topo B;
+	struct spr_node *root;
+	const void *rec;
+	uint64_t pos = 0;
+	long added = 0;
+	int i, id, *map;
+	void *perm;
+
+	if (!tree->dups) spr_dupset_init(tree);
+	set = tree->dups;
+	B = topo_at(tree->dupwork + 2*TOPO_ARRAYS*(size_t)n, n);
+	if (!(st = spr_dupstore_file(path, FALSE, n, tree->taxa, NULL, set->recsize, err)))
+		return -1;
+	map = xmalloc(tree->taxa * sizeof(*map));
+	perm = xmalloc(set->recsize);
+	for (i=0 ; i < tree->taxa ; i++){
+		if ((id = spr_dupstore_taxon(st, ((const struct spr_nodename *)set->taxdata[i])->name)) < 0){
+			*err = "it has different taxa";
+			added = -1;
+			goto out;
+		}
+		map[id] = i;
+	}
+
+	while ((rec = spr_dupstore_each(st, &pos))){
+		memcpy(perm, rec, set->recsize);
+		for (i=0 ; i < tree->taxa ; i++)
+			if (PARENTS_WIDE(set)) ((uint32_t *)perm)[map[i]] = ((const uint32_t *)rec)[i];
+			else ((uint16_t *)perm)[map[i]] = ((const uint16_t *)rec)[i];
+		expand_topo(set, perm, &B);
+		root = expand_nodes(set, &B, tree->dupnodes);
+		if (spr_add_dup(tree, root)){
+			added++;
+			if (fn) fn(root, arg);
+		}
 	}
-	free(saveB);
-	free(saveA);
-	free(A);
-	return p ? p->tree : NULL;
+ out:
+	spr_dupstore_close(st);
+	free(map);
+	free(perm);
+	return added;
+}
+
+int spr_dupstore_sync( struct spr_tree *tree )
+{
+	return !tree->dups || !tree->dups->store || spr_dupstore_commit(tree->dups->store);
+}
+
+/* For checkpoint.c: every (fp, record) pair of an in-memory set.  Records
+ * use the set's taxon numbers, which are always its trees' clade bit order. */
+size_t spr_dupset_count( const struct spr_dupset *set )
+{
+	size_t n = 0;
+	for (int i=0 ; i < (1 << SPR_DUPSHARDBITS) ; i++)
+		n += set->shards[i].count;
+	return n;
+}
+
+// nobody may be adding to the set meanwhile
+int spr_dupset_write( const struct spr_dupset *set, FILE *f )
+{
+	for (int i=0 ; i < (1 << SPR_DUPSHARDBITS) ; i++){
+		const struct spr_dupshard *s = &set->shards[i];
+		for (size_t j=0 ; j < s->size ; j++){
+			if (!s->table[j].fp) continue;
+			if (1 != fwrite(&s->table[j].fp, sizeof(s->table[j].fp), 1, f) ||
+			    1 != fwrite(s->table[j].rec, set->recsize, 1, f))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Read n pairs into tree's set, which must be unshared and freshly
+ * spr_dupset_clear()ed.  They're known to be different, so no compares. */
+int spr_dupset_read( struct spr_tree *tree, FILE *f, size_t n )
+{
+	struct spr_dupset *set = tree->dups;
+	struct spr_dupshard *s;
+	unsigned long long fp;
+	size_t i, mask;
+	void *rec;
+
+	while (n--){
+		rec = spr_arena_alloc(&tree->duprecs, set->recsize);
+		if (1 != fread(&fp, sizeof(fp), 1, f) || 1 != fread(rec, set->recsize, 1, f) || !fp)
+			return FALSE;
+		s = shardof(set, fp);
+		if (2*(s->count+1) > s->size){
+			enter(s);
+			grow(set, s);
+		}
+		mask = s->size-1;
+		for (i = fp & mask ; s->table[i].fp ; i = (i+1) & mask);
+		s->table[i].fp = fp;
+		s->table[i].rec = rec;
+		s->count++;
+		if (s->bloom) bloom_set(s, bloom_k(set->bloombits), fp);
+	}
+	return TRUE;
+}
+
+void spr_dupset_init( struct spr_tree *tree )
+{
+	spr_dupset_attach(tree, spr_dupset_new(tree));
 }
 
 
@@ -177,6 +828,39 @@ struct spr_node *spr_copytree( const struct spr_node *node )
 	return p;
 }
 
+/* preorder, with the same parent-pointer walk as initspr(), keeping c at
+ * the copy of the node we're at */
+struct spr_node *spr_copytree_in( struct spr_arena *a, const struct spr_node *node )
+{
+	struct spr_node *A = spr_arena_alloc(a, spr_countnodes(node) * sizeof(*A)), *p = A, *c = NULL;
+	const struct spr_node *s = node, *prev = NULL;
+
+	for (;;){
+		if (prev == (s == node ? NULL : s->parent)){ // first time to the node
+			p->left = p->right = NULL;
+			p->data = s->data;
+			p->parent = c;
+			if (c){
+				if (s == s->parent->left) c->left = p;
+				else c->right = p;
+			}
+			c = p++;
+			if (s->left){
+				prev = s; s = s->left;
+				continue;
+			}
+		}else if (prev == s->left){
+			prev = s; s = s->right;
+			continue;
+		}
+		// leaf, or back from the right subtree
+		if (s == node) break;
+		prev = s; s = s->parent;
+		c = c->parent;
+	}
+	return A;
+}
+
 size_t spr_copytoarray( struct spr_node *A, const struct spr_node *node )
 {
 	struct spr_node *p = A, *left, *right;
@@ -197,19 +881,8 @@ size_t spr_copytoarray( struct spr_node *A, const struct spr_node *node )
 	}
 }
 
-/* TODO: it might be faster to append to the tail of the list, so the most
- * common topologies stay at the front, where they're checked first. */
 int spr_add_dup( struct spr_tree *tree, struct spr_node *root )
 {
-	int tmp;
-	if (!spr_find_dup(tree, root)){
-		struct spr_duplist *p = xmalloc(sizeof(*p));
-		p->tree = xmalloc(tree->nodes * sizeof(*p->tree));
-		tmp = spr_copytoarray(p->tree, root);
-		assert( tree->nodes == tmp /* copytoarray had better copy the right number of nodes */ );
-		p->next = tree->dups;
-		tree->dups = p;
-		return TRUE;
-	}else
-		return FALSE;
+	assert( tree->nodes == spr_countnodes(root) );
+	return !dupset_lookup(tree, topo_build(tree, root), TRUE);
 }
@@ -0,0 +1,106 @@
+/* subtree pruning-regrafting (spr) library
+ * Peter Cordes <peter@cordes.ca>, Dalhousie University
+ * license: GPLv2 or later
+ */
+
+/* random rooted binary trees, for load tests and benchmarks.
+ * Every model adds taxa one at a time, each as the sibling of an existing
+ * node: any node (uniform), any leaf (Yule), the newest leaf (caterpillar),
+ * or each leaf of one level before the next (balanced).  That's O(1) per
+ * taxon, and nothing is recursive, so a million taxa is fine.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPR_PRIVATE
+#include "spr.h"
+
+static const char *models[] = { "uniform", "yule", "caterpillar", "balanced" };
+
+int spr_treemodel( const char *name )
+{
+	for (int i=0 ; i < (int)(sizeof(models)/sizeof(*models)) ; i++)
+		if (!strcmp(name, models[i])) return i;
+	return -1;
+}
+
+// xorshift64*
+static unsigned long long nextrand( unsigned long long *x )
+{
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+	return *x * 2685821657736338717ULL;
+}
+
+static struct spr_node *gennode( struct spr_newicktree *t, size_t datasize, int taxon )
+{
+	struct spr_node *p = spr_arena_alloc(&t->arena, sizeof(*p));
+	struct spr_newickdata *d = spr_arena_alloc(&t->arena, datasize);
+	char name[16];
+	int len;
+
+	memset(d, 0, datasize);
+	if (taxon){
+		len = snprintf(name, sizeof(name), "t%d", taxon);
+		d->name = spr_arena_alloc(&t->arena, len + 1);
+		memcpy(d->name, name, len + 1);
+		t->taxa++;
+	}else
+		d->name = "";
+	d->length = -1;
+	p->left = p->right = p->parent = NULL;
+	p->data = (void *)d;
+	t->nodes++;
+	return p;
+}
+
+struct spr_node *spr_randomtree( struct spr_newicktree *t, int ntaxa, int model,
+	unsigned long long seed, size_t datasize )
+{
+	struct spr_node **nodes, *x, *y, *leaf;
+	unsigned long long rng = seed ? seed : 0x9e3779b97f4a7c15ULL;  // must be non-zero
+	int k, n = 0, next = 0, levelend = 1;
+
+	if (ntaxa < 1 || model < 0 || model >= (int)(sizeof(models)/sizeof(*models))) return NULL;
+	if (datasize < sizeof(struct spr_newickdata)) datasize = sizeof(struct spr_newickdata);
+	t->nodes = t->taxa = 0;
+	spr_arena_reset(&t->arena);
+
+	// uniform picks from all the nodes, the rest from just the leaves
+	nodes = xmalloc((2*(size_t)ntaxa - 1) * sizeof(*nodes));
+	t->root = nodes[n++] = gennode(t, datasize, 1);
+	for (k=1 ; k<ntaxa ; k++){  // k taxa so far
+		switch (model){
+		case SPR_TREE_UNIFORM: x = nodes[nextrand(&rng) % n]; break;
+		case SPR_TREE_YULE: x = nodes[nextrand(&rng) % k]; break;
+		case SPR_TREE_CATERPILLAR: x = nodes[k-1]; break;
+		default:
+			if (next == levelend){ next = 0; levelend = k; }
+			x = nodes[next++];
+			break;
+		}
+
+		// y takes x's place, with x and the new leaf as its children
+		y = gennode(t, datasize, 0);
+		leaf = gennode(t, datasize, k+1);
+		y->parent = x->parent;
+		if (!x->parent) t->root = y;
+		else if (x->parent->left == x) x->parent->left = y;
+		else x->parent->right = y;
+		y->left = x;
+		y->right = leaf;
+		x->parent = leaf->parent = y;
+
+		if (model == SPR_TREE_UNIFORM){
+			nodes[n++] = y;
+			nodes[n++] = leaf;
+		}else
+			nodes[k] = leaf;
+	}
+	free(nodes);
+	return t->root;
+}
@@ -9,53 +9,31 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
-
+#include <string.h>
 #include <assert.h>
 
 #define SPR_PRIVATE
 #include "spr.h"
 
-/* format of sprmap_table (transposed):
-01 0122 012333  src
-10 2201 333012  dest
- size 2: 2 2
- size 3: 4 6
- size 4: 6 12
-space required: sum( i=2..n, 2*(i-1) ) = n*(n-1).
-* src = root entries are useless, but the root can move from 0.
-* Putting entries with src=root at the end could make it possible to vary the length
-* of the array that is covered.  A length with repeated prime factors could be
-* chosen, so the LCG that generates a sequence covering the whole space will be more
-* random
-*/
-
-/* TODO: replace sprmap_table with a function call, if there's a fast formula...
- * TODO: this should probably have some locking for re-entrancy, then the whole
- * library would be re-entrant.
- */
-
-// only called from spr_init.
-static void grow_map( int nnodes )
-{
-	int i, n;	      // the number we're currently filling in
-	int newsize = nnodes*(nnodes-1);
+// used by spr_init().  Tables grow as needed, so it's not thread-safe.
+static struct spr_context default_ctx = { .seed = 1 };
 
-	if ((n=sprmapnodes) < 2) n=2; // start where we left off last time
+void spr_setdebug(int level){ default_ctx.debug = level; }
 
-	if (nnodes < 2 || nnodes <= sprmapnodes) return; 
-	sprmap_table = xrealloc( sprmap_table, newsize * sizeof(*sprmap_table) ); // realloc(NULL,...) is malloc
-	sprmapnodes = nnodes;
- 
-	for( ; n<=nnodes ; n++ ){
-		for( i=0 ; i<n-1 ; i++ ){
-			sprmap_table[(n-1)*(n-2) + i][0] = i;
-			sprmap_table[(n-1)*(n-2) + i][1] = n-1;
+struct spr_context *spr_context_new( int maxnodes, unsigned long long seed )
+{
+	struct spr_context *ctx = xcalloc(1, sizeof(*ctx));
+	ctx->seed = seed;
+	ctx->maxnodes = maxnodes;
+	spr_lcg_setup(ctx, spr_maxmoves(maxnodes));
+	ctx->fixed = TRUE;
+	return ctx;
+}
 
-			sprmap_table[(n-1)*(n-2) + i + n-1][0] = n-1;
-			sprmap_table[(n-1)*(n-2) + i + n-1][1] = i;
-			// == (n-1)*(n-1) + i
-		}
-	}
+void spr_context_free( struct spr_context *ctx )
+{
+	spr_lcg_ctxfree( ctx );
+	if (ctx != &default_ctx) free( ctx );
 }
 
 
@@ -66,8 +44,8 @@ static void grow_map( int nnodes )
 static void initspr( struct spr_tree *state, struct spr_node *tree )
 {
 	struct spr_node *p, *q;
-	int n=0, nsize=15;
-	struct spr_node **nodelist = xmalloc( nsize*sizeof(*nodelist) );
+	int n=0, nsize = state->nodelist ? state->nodelistsize : 15;
+	struct spr_node **nodelist = state->nodelist ? state->nodelist : xmalloc( nsize*sizeof(*nodelist) );
 
 	state->nodes = state->taxa = 0;
 
@@ -88,6 +66,8 @@ static void initspr( struct spr_tree *state, struct spr_node *tree )
   "libspr: invalid tree detected:\n"
   "internal nodes must have left and right subtrees\n"
   "node \"%s\" has one but not the other.\n", p->data->name );
+				state->nodelist = nodelist;
+				state->nodelistsize = nsize;
 				state->nodes=-1;
 				return;
 			}
@@ -107,41 +87,152 @@ static void initspr( struct spr_tree *state, struct spr_node *tree )
 		}
 	}
 
-	state->nodelist = xrealloc( nodelist, n*sizeof(*nodelist) );
+	state->nodelist = nodelist;  // not shrunk, so spr_reinit can reuse it
+	state->nodelistsize = nsize;
 	state->nodes = n;	// taxa were counted as we went
 }
 
+/* hash table to map node pointers back to nodelist indices */
+static void init_nodeidx( struct spr_tree *t )
+{
+	int i, j, mask;
+	for (t->nodeidxsize = 16 ; t->nodeidxsize < 2*t->nodes ; t->nodeidxsize *= 2);
+	mask = t->nodeidxsize - 1;
+	memset(t->nodeidx, 0, t->nodeidxsize * sizeof(*t->nodeidx));
+	for (i=0 ; i < t->nodes ; i++){
+		for (j = mix64((size_t)t->nodelist[i]) & mask ; t->nodeidx[j].node ; j = (j+1) & mask);
+		t->nodeidx[j].node = t->nodelist[i];
+		t->nodeidx[j].idx = i;
+		t->nodeidx[j].namelen = t->nodelist[i]->data ? strlen(t->nodelist[i]->data->name) : 0;
+		t->nodeidx[j].quote = spr_newick_needsquote(t->nodelist[i]->data ? t->nodelist[i]->data->name : "", t->nodeidx[j].namelen);
+	}
+}
+
+/* Bit i of a node's clade is the leaf taxonlist[i].  A postorder walk with
+ * parent pointers, so it works for any topology of the nodes, e.g. after
+ * spr_restore() rewires them. */
+void spr_clades_rebuild( struct spr_tree *t )
+{
+	const int w = t->cladewords;
+	const struct spr_node *p = t->root, *prev = NULL;
+	unsigned long long *c;
+	int bit;
+
+	memset(t->clades, 0, (size_t)t->nodes * w * sizeof(*t->clades));
+	for (bit=0 ; bit < t->taxa ; bit++)
+		t->clades[(size_t)spr_nodeindex(t, t->taxonlist[bit])*w + bit/64] = 1ULL << (bit%64);
+
+	for (;;){
+		if (prev == p->parent && p->left){ // first time to an internal node
+			prev = p; p = p->left;
+			continue;
+		}
+		if (prev == p->left && p->left){
+			prev = p; p = p->right;
+			continue;
+		}
+		if (p->left){ // both subtrees done
+			const unsigned long long *l = spr_clade(t, p->left), *r = spr_clade(t, p->right);
+			c = t->clades + (size_t)spr_nodeindex(t, p)*w;
+			for (int k=0 ; k<w ; k++) c[k] = l[k] | r[k];
+		}
+		if (p == t->root) break;
+		prev = p; p = p->parent;
+	}
+}
+
+// leaves get clade bits in nodelist (preorder) order
+static void init_clades( struct spr_tree *t )
+{
+	int i, bit;
+
+	t->cladewords = (t->taxa + 63) / 64;
+	for (i=0, bit=0 ; i < t->nodes ; i++)
+		if (isleaf(t->nodelist[i]))
+			t->taxonlist[bit++] = t->nodelist[i];
+	spr_clades_rebuild(t);
+}
+
 
 /* return malloc()ed library state, or NULL on error */
 struct spr_tree *
 spr_init( struct spr_node *root, void (*callback)(struct spr_node *), int dup )
 {
-	int nnodes;
-	struct spr_tree *tree;
+	return spr_init_ctx( &default_ctx, root, callback, dup );
+}
 
-	if (!root) return NULL;
+/* (re)size the per-node buffers for trees of up to n nodes.  A rooted binary
+ * tree has (n+1)/2 taxa, so that sizes the clade bitsets too. */
+static void reserve( struct spr_tree *tree, int n )
+{
+	int idxsize, w = ((n+1)/2 + 63) / 64;
+	if (n <= tree->capacity) return;
+	for (idxsize = 16 ; idxsize < 2*n ; idxsize *= 2);
+	free(tree->nodeidx);
+	free(tree->clades);
+	free(tree->cladework);
+	free(tree->taxonlist);
+	free(tree->movepre);
+	tree->nodeidx = xmalloc(idxsize * sizeof(*tree->nodeidx));
+	tree->clades = xmalloc((size_t)n * w * sizeof(*tree->clades));
+	tree->cladework = xmalloc(2 * w * sizeof(*tree->cladework));
+	tree->taxonlist = xmalloc(((n+1)/2) * sizeof(*tree->taxonlist));
+	tree->movepre = xmalloc((8*n + 2) * sizeof(*tree->movepre));
+	tree->capacity = n;
+}
+
+// everything but the dup set.  FALSE if the tree is no good
+static int setup( struct spr_tree *tree, struct spr_node *root )
+{
+	struct spr_context *ctx = tree->ctx;
+	int nnodes;
 
-	tree = xmalloc( sizeof(*tree) );
 	tree->root = root;
 	initspr( tree, root );
 	// TODO: sort nodelist?
 
 	nnodes = tree->nodes;
-	if (nnodes < 4) goto out_err;
-// TODO: either be re-entrant or forget about it...
-	if (nnodes > (volatile int)sprmapnodes) grow_map( nnodes );
-
- // set up and initialize an LCG that will cover all source/dest pairs
-	findlcg( &tree->lcg, nnodes*(nnodes-1) );
-	tree->callback = callback;
+	if (nnodes < 4) return FALSE;
+	if (nnodes > ctx->maxnodes){
+		if (ctx->fixed) return FALSE;
+		ctx->maxnodes = nnodes;
+	}
+	reserve( tree, nnodes );
+	init_nodeidx( tree );
+	init_clades( tree );
+
+	tree->moveend = tree->movepre + nnodes;
+	tree->moveorder = tree->moveend + nnodes;
+	tree->movepar = tree->moveorder + nnodes;
+	tree->movesib = tree->movepar + nnodes;
+	tree->movedepth = tree->movesib + nnodes;
+	tree->movecum = tree->movedepth + nnodes;
+	tree->moveupcum = tree->movecum + nnodes + 1;
+ // seed an LCG, and size the primes for any topology.  spr_apply sizes it for this one.
+	findlcg( ctx, &tree->lcg, spr_maxmoves(nnodes), tree->initno );
 	spr_apply(tree);	// basically an init function
+	return TRUE;
+}
+
+struct spr_tree *
+spr_init_ctx( struct spr_context *ctx, struct spr_node *root, void (*callback)(struct spr_node *), int dup )
+{
+	struct spr_tree *tree;
+
+	if (!root) return NULL;
 
-	if(dup) tree->dups = NULL;
-	else{
-		tree->dups = xmalloc(sizeof(*tree->dups));
-		tree->dups->next = NULL;
-		tree->dups->tree = xmalloc(nnodes * sizeof(*tree->dups->tree));
-		spr_copytoarray(tree->dups->tree, tree->root);
+	tree = xcalloc( 1, sizeof(*tree) );  // NULL pointers for spr_statefree
+	tree->ctx = ctx;
+	tree->callback = callback;
+	tree->initno = __sync_fetch_and_add(&ctx->inits, 1);
+#ifdef SPR_STATS
+	tree->stats = xcalloc( 1, sizeof(*tree->stats) );
+#endif
+	if (!setup( tree, root )) goto out_err;
+
+	if(!dup){
+		spr_dupset_init(tree);
+		spr_add_dup(tree, tree->root);
 	}
 
 	return tree;
@@ -150,6 +241,24 @@ spr_init( struct spr_node *root, void (*callback)(struct spr_node *), int dup )
 	return NULL;
 }
 
+/* Point tree at a new start tree, keeping its buffers (and its dup set's, if
+ * no other tree shares it).  They only grow when this tree is bigger than any
+ * before.  The set forgets everything, and starts over with this tree, and
+ * the LCG starts where it did for the first one, so each start tree gets the
+ * same SPR order as it would from its own spr_init(). */
+int spr_reinit( struct spr_tree *tree, struct spr_node *root )
+{
+	if (!root || !setup( tree, root )) return FALSE;
+	if (tree->dups){
+		if (!spr_dupset_clear(tree)){
+			spr_dupset_detach(tree);
+			spr_dupset_init(tree);
+		}
+		spr_add_dup(tree, tree->root);
+	}
+	return TRUE;
+}
+
 
 /********** free() functions ***************/
 
@@ -164,31 +273,41 @@ void spr_treefree( struct spr_node *p, int freedata )
 	free( p );
 }	
 
+void spr_treefree_arena( struct spr_arena *a )
+{
+	spr_arena_free(a);
+}
+
 void spr_statefree( struct spr_tree *tree )
 {
-	for( struct spr_duplist *d = tree->dups ; d ; d=d->next )
-		free(d->tree); // the dup list is block-allocated
+	spr_dupset_detach(tree);
 	if (tree->nodelist)
 		free(tree->nodelist);
+	free(tree->nodeidx);
+	free(tree->clades);
+	free(tree->cladework);
+	free(tree->taxonlist);
+	free(tree->movepre);
+	free(tree->stats);
 	free(tree);
 }
 
 /* free the private resources allocated by the library */
 void spr_staticfree( void )
 {
-	sprmapnodes = 0;
-	free( sprmap_table );
-	sprmap_table = NULL;
-	spr_lcg_staticfree();
+	spr_context_free( &default_ctx );
+	default_ctx.maxnodes = 0;
 }
 
 void spr_libsprtest( struct spr_tree *st )
 {
 	printf("nodes = %d\n", st->nodes);
 	int i, n;
-	n=sprmapnodes;
-	puts("sprmap_table:");
+	n=st->ctx->maxnodes;
+	puts("sprmap:");
 	for( i=0 ; i<n*(n-1) ; i++ ){
-		printf("%d %d\n", sprmap_table[i][0], sprmap_table[i][1] );
+		int src, dest;
+		spr_decode(i, &src, &dest);
+		printf("%d %d\n", src, dest);
 	}
 }
@@ -7,64 +7,618 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <assert.h>
+#include <sys/uio.h>
 
 #define SPR_PRIVATE
 #include "spr.h"
 
-// half-assed newick parser is in the front-end brontler.c.  A better parser
-// will go here...
+/******** newick parser ********/
 
-struct newickprinter {
-  char *string;
-  int total_len;
+/* One pass over the string, with an explicit stack of open internal nodes
+ * instead of recursion.  A node with more than two children is resolved
+ * into a left comb: each extra child pushes the ones so far down into a new
+ * unlabelled node, so the outermost node keeps the label and branch length.
+ * Everything the tree needs comes from t->arena, which is reused for the
+ * next tree, apart from taxon names when there's a taxon table. */
+
+static char noname[] = "";	// unlabelled nodes share it.  never written
+static const char delims[] = "()[]':;, \t\n\r\f\v";	// end an unquoted label
+
+static struct spr_node *parsenode( struct spr_newicktree *t, size_t datasize, char *name )
+{
+	struct spr_node *p = spr_arena_alloc(&t->arena, sizeof(*p));
+	struct spr_newickdata *d = spr_arena_alloc(&t->arena, datasize);
+	memset(d, 0, datasize);
+	d->name = name;
+	d->length = -1;
+	p->left = p->right = p->parent = NULL;
+	p->data = (void *)d;
+	t->nodes++;
+	return p;
+}
+
+static void addchild( struct spr_newicktree *t, size_t datasize, struct spr_node *n, int k, struct spr_node *c )
+{
+	struct spr_node *m;
+	if (k == 0) n->left = c;
+	else if (k == 1) n->right = c;
+	else{
+		m = parsenode(t, datasize, noname);
+		m->left = n->left; m->right = n->right;
+		m->left->parent = m->right->parent = m;
+		m->parent = n;
+		n->left = m;
+		n->right = c;
+	}
+	c->parent = n;
+}
+
+// skip white space and [comments].  FALSE for an unterminated comment
+static int skipws( const char *s, size_t len, size_t *i )
+{
+	size_t j;
+	for (;;){
+		while (*i < len && (s[*i] == ' ' || s[*i] == '\t' || s[*i] == '\n' || s[*i] == '\r' || s[*i] == '\f' || s[*i] == '\v'))
+			++*i;
+		if (*i >= len || s[*i] != '[') return TRUE;
+		for (j = *i ; j < len && s[j] != ']' ; j++);
+		if (j >= len) return FALSE;
+		*i = j + 1;
+	}
+}
+
+/* find the label at s[*i]: quoted with ' (and '' for a '), or up to a
+ * delimiter.  *p and *n get its text, and *esc the number of ''s in it.
+ * FALSE for an unterminated quote. */
+static int scanlabel( const char *s, size_t len, size_t *i, const char **p, size_t *n, size_t *esc )
+{
+	size_t j;
+	*esc = 0;
+	if (*i < len && s[*i] == '\''){
+		for (j = *i + 1 ; j < len ; j++)
+			if (s[j] == '\''){
+				if (j+1 < len && s[j+1] == '\''){ j++; ++*esc; }
+				else break;
+			}
+		if (j >= len) return FALSE;
+		*p = s + *i + 1;
+		*n = j - *i - 1;
+		*i = j + 1;
+		return TRUE;
+	}
+	for (j = *i ; j < len && !strchr(delims, s[j]) ; j++);
+	*p = s + *i;
+	*n = j - *i;
+	*i = j;
+	return TRUE;
+}
+
+// nul-terminated copy of a label's text, without the '' escapes
+static void unescape( char *dst, const char *p, size_t n )
+{
+	size_t j;
+	for (j=0 ; j<n ; j++){
+		*dst++ = p[j];
+		if (p[j] == '\'') j++;
+	}
+	*dst = '\0';
+}
+
+static unsigned int namehash( const char *p, size_t n )
+{
+	unsigned int h = 2166136261u;  // FNV-1a
+	while (n--) h = (h ^ (unsigned char)*p++) * 16777619u;
+	return h;
+}
+
+/* the table's copy of taxon name p[0..n), added if it's new and the table
+ * isn't frozen.  NULL and *msg if it can't be in this tree. */
+static char *intern( struct spr_taxontable *tab, const char *p, size_t n, const char **msg )
+{
+	const unsigned int h = namehash(p, n);
+	unsigned int i, mask = tab->size - 1;
+	struct spr_taxonent *e;
+
+	for (i = h & mask ; (e = &tab->table[i])->name ; i = (i+1) & mask)
+		if (e->hash == h && e->len == n && !memcmp(e->name, p, n)){
+			if (e->seen == tab->gen){
+				*msg = "taxon appears twice";
+				return NULL;
+			}
+			e->seen = tab->gen;
+			return e->name;
+		}
+	if (tab->frozen){
+		*msg = "taxon isn't in the taxon table";
+		return NULL;
+	}
+	if (2*(tab->ntaxa+1) > tab->size){ // grow and rehash
+		struct spr_taxonent *old = tab->table;
+		int j, oldsize = tab->size;
+		tab->size *= 2;
+		tab->table = xcalloc(tab->size, sizeof(*tab->table));
+		mask = tab->size - 1;
+		for (j=0 ; j<oldsize ; j++){
+			if (!old[j].name) continue;
+			for (i = old[j].hash & mask ; tab->table[i].name ; i = (i+1) & mask);
+			tab->table[i] = old[j];
+		}
+		free(old);
+		return intern(tab, p, n, msg);
+	}
+	e->name = spr_arena_alloc(&tab->names, n + 1);
+	memcpy(e->name, p, n);
+	e->name[n] = '\0';
+	e->len = n;
+	e->hash = h;
+	e->seen = tab->gen;
+	tab->ntaxa++;
+	return e->name;
+}
+
+/* The label at s[*i].  Returns noname if there isn't one, or NULL and *msg
+ * if something's wrong with it.  Taxa go through t->taxa if there is one:
+ * unquoted (and unescaped) names are looked up right where they are in s. */
+static char *label( struct spr_newicktree *t, const char *s, size_t len, size_t *i, int leaf, const char **msg )
+{
+	const char *p;
+	size_t n, esc;
+	char *name;
+
+	if (!scanlabel(s, len, i, &p, &n, &esc)){
+		*msg = "unterminated quoted label";
+		return NULL;
+	}
+	if (!n) return noname;
+	if (leaf && t->taxa_table){
+		struct spr_taxontable *tab = t->taxa_table;
+		if (esc){
+			if (n + 1 > tab->scratchsize){
+				tab->scratchsize = 2*n + 1;
+				tab->scratch = xrealloc(tab->scratch, tab->scratchsize);
+			}
+			unescape(tab->scratch, p, n);
+			p = tab->scratch;
+			n -= esc;
+		}
+		return intern(tab, p, n, msg);
+	}
+	name = spr_arena_alloc(&t->arena, n - esc + 1);
+	unescape(name, p, n);
+	return name;
+}
+
+// a branch length at s[*i].  FALSE if there isn't a number there
+static int number( const char *s, size_t len, size_t *i, double *x )
+{
+	char buf[64], *e;
+	size_t n;
+	for (n = 0 ; *i + n < len && n < sizeof(buf)-1 && strchr("0123456789+-.eE", s[*i + n]) && s[*i + n] ; n++)
+		buf[n] = s[*i + n];
+	buf[n] = '\0';
+	*x = strtod(buf, &e);
+	if (e == buf) return FALSE;
+	*i += e - buf;
+	return TRUE;
+}
+
+int spr_parse_newick( struct spr_newicktree *t, const char *s, size_t len,
+	size_t datasize, size_t *end, const char **err )
+{
+	struct spr_node **stack = NULL, *p = NULL;
+	int *nkids = NULL, depth = 0, stacksize = 0, want_subtree = TRUE;
+	const char *msg = NULL;
+	size_t i = 0, start;
+	char *name;
+
+	if (datasize < sizeof(struct spr_newickdata)) datasize = sizeof(struct spr_newickdata);
+	t->root = NULL;
+	t->nodes = t->taxa = 0;
+	spr_arena_reset(&t->arena);
+	if (t->taxa_table) t->taxa_table->gen++;
+
+	for (;;){
+		if (!skipws(s, len, &i)){ msg = "unterminated [comment]"; goto fail; }
+		if (want_subtree){
+			if (i < len && s[i] == '('){
+				if (depth == stacksize){
+					stacksize = max(2*stacksize, 64);
+					stack = xrealloc(stack, stacksize * sizeof(*stack));
+					nkids = xrealloc(nkids, stacksize * sizeof(*nkids));
+				}
+				stack[depth] = parsenode(t, datasize, noname);
+				nkids[depth++] = 0;
+				i++;
+				continue;
+			}
+			start = i;
+			if (!(name = label(t, s, len, &i, TRUE, &msg))){ i = start; goto fail; }
+			if (name == noname){ msg = "expected a taxon name or '('"; goto fail; }
+			p = parsenode(t, datasize, name);
+			t->taxa++;
+			want_subtree = FALSE;
+			continue;
+		}
+
+		// p is finished except maybe for a branch length
+		if (i < len && s[i] == ':'){
+			i++;
+			if (!skipws(s, len, &i)){ msg = "unterminated [comment]"; goto fail; }
+			if (!number(s, len, &i, &((struct spr_newickdata *)p->data)->length)){
+				msg = "expected a branch length after ':'";
+				goto fail;
+			}
+			if (!skipws(s, len, &i)){ msg = "unterminated [comment]"; goto fail; }
+		}
+		if (!depth) break;
+
+		addchild(t, datasize, stack[depth-1], nkids[depth-1]++, p);
+		if (i < len && s[i] == ','){
+			i++;
+			want_subtree = TRUE;
+			continue;
+		}
+		if (i >= len || s[i] != ')'){ msg = "expected ',' or ')'"; goto fail; }
+		if (nkids[depth-1] < 2){ msg = "only one subtree inside ( )"; goto fail; }
+		p = stack[--depth];
+		i++;
+		if (!skipws(s, len, &i)){ msg = "unterminated [comment]"; goto fail; }
+		if (!(name = label(t, s, len, &i, FALSE, &msg))) goto fail;
+		((struct spr_newickdata *)p->data)->name = name;
+	}
+
+	if (i < len && s[i] == ';') i++;
+	else if (i < len && s[i]){ msg = "expected ';'"; goto fail; }
+	if (t->taxa_table && t->taxa_table->frozen && t->taxa != t->taxa_table->ntaxa){
+		msg = "tree doesn't have every taxon in the taxon table";
+		goto fail;
+	}
+	t->root = p;
+	free(stack);
+	free(nkids);
+	if (end) *end = i;
+	return TRUE;
+
+fail:
+	free(stack);
+	free(nkids);
+	spr_arena_reset(&t->arena);
+	t->nodes = t->taxa = 0;
+	if (end) *end = i;
+	if (err) *err = msg;
+	return FALSE;
+}
+
+void spr_newicktree_init( struct spr_newicktree *t, struct spr_taxontable *taxa )
+{
+	t->root = NULL;
+	t->nodes = t->taxa = 0;
+	t->taxa_table = taxa;
+	spr_arena_init(&t->arena, 0);
+}
+
+void spr_newicktree_free( struct spr_newicktree *t )
+{
+	spr_arena_free(&t->arena);
+	t->root = NULL;
+}
+
+void spr_taxontable_init( struct spr_taxontable *tab )
+{
+	tab->size = 64;
+	tab->table = xcalloc(tab->size, sizeof(*tab->table));
+	tab->ntaxa = 0;
+	tab->frozen = FALSE;
+	tab->gen = 0;
+	spr_arena_init(&tab->names, 0);
+	tab->scratch = NULL;
+	tab->scratchsize = 0;
+}
+
+void spr_taxontable_free( struct spr_taxontable *tab )
+{
+	free(tab->table);
+	free(tab->scratch);
+	spr_arena_free(&tab->names);
+	tab->table = NULL;
+}
+
+
+/* The writer walks the tree with parent pointers, so no recursion, and
+ * output goes through put() to either a growable buffer or a FILE. */
+struct sink{
+	struct spr_newickbuf *b;	// NULL for f
+	FILE *f;
+	size_t *spans;	// if not NULL: where each node's subtree, and its label, start in b, and where it ends
 };
 
-/* FIXME: this function needs to be able to realloc the string
- * to handle long taxa names.  
- * And while we're at it, optionally include branch lengths */
-static int newick_recurse_unsafe( char *s, const struct spr_node *p )
-{
-	int tmp;
-	if (!p->left){ // leaf
-		assert( !p->right );
-		return sprintf( s, "%s", p->data->name );
-	}else{			// internal
-	   // single-child internal nodes make no sense in phylogenetic trees
-		assert( p->left && p->right );
-		*s = '('; tmp=1;
-		tmp += newick_recurse_unsafe( s+tmp, p->left );
-		s[tmp] = ','; tmp++;
-		tmp += newick_recurse_unsafe( s+tmp, p->right );
-		s[tmp] = ')'; tmp++;
-		return tmp;
-	}		
+static void reserve( struct spr_newickbuf *b, size_t n )
+{
+	if (b->len + n + 1 > b->size){	// +1 for the nul
+		b->size = max(max(2*b->size, b->len + n + 1), (size_t)256);
+		b->s = xrealloc(b->s, b->size);
+	}
 }
-/*
-struct newickprint{
-	char *str;
-	size_t space;
+
+static inline void put( struct sink *k, const char *s, size_t n )
+{
+	if (k->f){
+		if (n == 1) putc(*s, k->f);
+		else fwrite(s, 1, n, k->f);
+	}else{
+		reserve(k->b, n);
+		memcpy(k->b->s + k->b->len, s, n);
+		k->b->len += n;
+	}
+}
+
+int spr_newick_needsquote( const char *name, size_t len ){
+	return strcspn(name, delims) < len; }
+
+// name, in quotes with '' for ' if the parser wouldn't read it back as one label
+static void putlabel( struct sink *k, const char *s, size_t n, int quote )
+{
+	const char *q;
+	if (!quote){
+		put(k, s, n);
+		return;
+	}
+	put(k, "'", 1);
+	for ( ; (q = memchr(s, '\'', n)) ; n -= q+1 - s, s = q+1){
+		put(k, s, q+1 - s);
+		put(k, "'", 1);
+	}
+	put(k, s, n);
+	put(k, "'", 1);
+}
+
+static void putname( struct sink *k, const struct spr_tree *t, const struct spr_node *p )
+{
+	const struct spr_nodeidx *e;
+	int i, mask;
+	size_t n;
+
+	if (!p->data) return;
+	if (t){  // spr_nodeindex() by hand, for the cached length
+		mask = t->nodeidxsize - 1;
+		for (i = mix64((size_t)p) & mask ; (e = &t->nodeidx[i])->node ; i = (i+1) & mask)
+			if (e->node == p){
+				putlabel(k, p->data->name, e->namelen, e->quote);
+				return;
+			}
+	}
+	n = strlen(p->data->name);
+	putlabel(k, p->data->name, n, spr_newick_needsquote(p->data->name, n));
+}
+
+static void emit( struct sink *k, const struct spr_tree *t, const struct spr_node *root,
+	double (*bl)(const struct spr_node *p, void *arg), void *arg )
+{
+	const struct spr_node *p = root, *prev = root->parent;
+	char num[32];
+	double len;
+
+	for (;;){
+		if (prev == p->parent && k->spans)
+			k->spans[3*spr_nodeindex(t, p)] = k->spans[3*spr_nodeindex(t, p) + 1] = k->b->len;
+		if (prev == p->parent && p->left){ // coming down to an internal node
+			put(k, "(", 1);
+			prev = p; p = p->left;
+			continue;
+		}
+		if (prev == p->parent){
+			// single-child internal nodes make no sense in phylogenetic trees
+			assert( !p->right );
+			putname(k, t, p);
+		}else if (prev == p->left){
+			put(k, ",", 1);
+			prev = p; p = p->right;
+			continue;
+		}else{
+			put(k, ")", 1);
+			if (k->spans) k->spans[3*spr_nodeindex(t, p) + 1] = k->b->len;
+			putname(k, t, p);  // internal labels too, so the parser gets the same tree back
+		}
+
+		// done with p's subtree
+		if (k->spans) k->spans[3*spr_nodeindex(t, p) + 2] = k->b->len;
+		if (bl && p != root && (len = bl(p, arg)) >= 0)
+			put(k, num, snprintf(num, sizeof(num), ":%g", len));
+		if (p == root) break;
+		prev = p; p = p->parent;
+	}
+	put(k, ";", 1);
+}
+
+size_t spr_newick_buf( struct spr_newickbuf *b, const struct spr_tree *t, const struct spr_node *root,
+	double (*bl)(const struct spr_node *p, void *arg), void *arg )
+{
+	struct sink k = { b, NULL, NULL };
+	SPR_TIMER(t0);
+	b->len = 0;
+	emit(&k, t, root, bl, arg);
+	reserve(b, 0);
+	b->s[b->len] = '\0';
+	SPR_TIMED(t, newick, t0);
+	return b->len;
+}
+
+void spr_newickbuf_free( struct spr_newickbuf *b )
+{
+	free(b->s);
+	b->s = NULL;
+	b->len = b->size = 0;
+}
+
+void spr_newick_write( FILE *stream, const struct spr_tree *t, const struct spr_node *root,
+	double (*bl)(const struct spr_node *p, void *arg), void *arg )
+{
+	struct sink k = { NULL, stream, NULL };
+	SPR_TIMER(t0);
+	emit(&k, t, root, bl, arg);
+	SPR_TIMED(t, newick, t0);
+}
+
+
+/******** ropes: neighbours from cached subtree text ********/
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct spr_rope{
+	struct spr_newickbuf text;	// the start topology
+	size_t *spans;		// nodelist[i]'s subtree is text.s[spans[3i] .. spans[3i+2]), its label from spans[3i+1]
+	unsigned *dirty;	// == gen: the current move changed the node's subtree
+	unsigned gen;
+	struct iovec *iov;	// the pieces of the current tree
+	int niov, iovsize;
 };
-// not finished
-static int newick_recurse(const struct spr_node *p, struct newickprint *str, int pos)
-{
-	int tmp;
-	char *s = str.str+pos;
-	if (!p->left){ // leaf
-		assert( !p->right );
-		return sprintf( str+pos, "%s", p->data->name );
-	}else{			// internal
-	   // single-child internal nodes make no sense in phylogenetic trees
-		assert( p->left && p->right );
-		*s = '('; tmp=1;
-		tmp += newick_recurse( s+tmp, p->left );
-		s[tmp] = ','; tmp++;
-		tmp += newick_recurse( s+tmp, p->right );
-		s[tmp] = ')'; tmp++;
-		return tmp;
-	}		
-}
-*/
+
+static const char punct[] = "(,);\n";
+
+void spr_rope_reset( struct spr_rope *r, const struct spr_tree *t )
+{
+	struct sink k = { &r->text, NULL, NULL };
+
+	assert( !t->unspr_dest /* must be at the start topology */ );
+	r->spans = xrealloc(r->spans, 3 * t->nodes * sizeof(*r->spans));
+	r->dirty = xrealloc(r->dirty, t->nodes * sizeof(*r->dirty));
+	memset(r->dirty, 0, t->nodes * sizeof(*r->dirty));
+	r->gen = 0;
+	k.spans = r->spans;
+	r->text.len = 0;
+	emit(&k, t, t->root, NULL, NULL);
+}
+
+struct spr_rope *spr_rope_new( const struct spr_tree *t )
+{
+	struct spr_rope *r = xcalloc(1, sizeof(*r));
+	spr_rope_reset(r, t);
+	return r;
+}
+
+void spr_rope_free( struct spr_rope *r )
+{
+	spr_newickbuf_free(&r->text);
+	free(r->spans);
+	free(r->dirty);
+	free(r->iov);
+	free(r);
+}
+
+static void piece( struct spr_rope *r, const char *s, size_t n )
+{
+	if (r->niov == r->iovsize){
+		r->iovsize = max(2*r->iovsize, 64);
+		r->iov = xrealloc(r->iov, r->iovsize * sizeof(*r->iov));
+	}
+	r->iov[r->niov].iov_base = (char *)s;
+	r->iov[r->niov].iov_len = n;
+	r->niov++;
+}
+
+// mark p and its ancestors, up to one that's already marked
+static void markpath( struct spr_rope *r, const struct spr_tree *t, const struct spr_node *p )
+{
+	int i;
+	for ( ; p && r->dirty[i = spr_nodeindex(t, p)] != r->gen ; p = p->parent)
+		r->dirty[i] = r->gen;
+}
+
+/* Add t's current topology to the pieces, as spans of the start tree's text
+ * plus punctuation for the nodes whose subtrees the move changed: the
+ * ancestors of where it pruned and where it regrafted.  Ends with the ;. */
+static void pieces( struct spr_rope *r, const struct spr_tree *t )
+{
+	const struct spr_node *p = t->root, *prev = NULL;
+	int i;
+
+	if (!++r->gen){  // wrapped: start the marks over
+		memset(r->dirty, 0, t->nodes * sizeof(*r->dirty));
+		r->gen = 1;
+	}
+	if (t->unspr_dest){
+		if (!t->unspr_upper) markpath(r, t, t->unspr_src->parent);
+		markpath(r, t, t->unspr_dest->parent);
+	}
+
+	for (;;){
+		if (prev == p->parent){
+			i = spr_nodeindex(t, p);
+			if (r->dirty[i] == r->gen){
+				piece(r, punct, 1);  // (
+				prev = p; p = p->left;
+				continue;
+			}
+			piece(r, r->text.s + r->spans[3*i], r->spans[3*i+2] - r->spans[3*i]);
+		}else if (prev == p->left){
+			piece(r, punct+1, 1);  // ,
+			prev = p; p = p->right;
+			continue;
+		}else{
+			piece(r, punct+2, 1);  // )
+			i = spr_nodeindex(t, p);
+			if (r->spans[3*i+2] > r->spans[3*i+1])  // the label, from the start tree's text
+				piece(r, r->text.s + r->spans[3*i+1], r->spans[3*i+2] - r->spans[3*i+1]);
+		}
+
+		if (p == t->root) break;
+		prev = p; p = p->parent;
+	}
+	piece(r, punct+3, 1);  // ;
+}
+
+size_t spr_rope_buf( struct spr_rope *r, const struct spr_tree *t, struct spr_newickbuf *b )
+{
+	int i;
+	SPR_TIMER(t0);
+	r->niov = 0;
+	pieces(r, t);
+	b->len = 0;
+	for (i=0 ; i<r->niov ; i++){
+		reserve(b, r->iov[i].iov_len);
+		memcpy(b->s + b->len, r->iov[i].iov_base, r->iov[i].iov_len);
+		b->len += r->iov[i].iov_len;
+	}
+	reserve(b, 0);
+	b->s[b->len] = '\0';
+	SPR_TIMED(t, newick, t0);
+	return b->len;
+}
+
+int spr_rope_writev( struct spr_rope *r, const struct spr_tree *t, int fd, const char *prefix )
+{
+	struct iovec *iov;
+	ssize_t done;
+	int n;
+
+	SPR_TIMER(t0);
+	r->niov = 0;
+	if (prefix) piece(r, prefix, strlen(prefix));
+	pieces(r, t);
+	piece(r, punct+4, 1);  // newline
+	SPR_TIMED(t, newick, t0);  // just the text, not the syscall
+	iov = r->iov;
+	n = r->niov;
+	while (n > 0){
+		done = writev(fd, iov, min(n, IOV_MAX));
+		if (done < 0){
+			if (errno == EINTR) continue;
+			return FALSE;
+		}
+		for ( ; n > 0 && (size_t)done >= iov->iov_len ; iov++, n--)
+			done -= iov->iov_len;
+		if (n > 0){  // short write
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	return TRUE;
+}
 
 /*
       A
@@ -74,22 +628,15 @@ static int newick_recurse(const struct spr_node *p, struct newickprint *str, int
  * (without branch lengths) */
 char *newick( const struct spr_node *tree )
 {
-	int len;
-	int maxlen = 100*spr_countnodes(tree);
-	char *string = xmalloc( maxlen ); // plenty of space
-	len = newick_recurse_unsafe( string, tree );
-	string[len++] = ';';
-	string[len++] = '\0';
-	assert (len <= maxlen);
-	string = xrealloc( string, len );
-	return string;
+	struct spr_newickbuf b = { NULL, 0, 0 };
+	spr_newick_buf(&b, NULL, tree, NULL, NULL);
+	return xrealloc(b.s, b.len + 1);
 }
 
 void newickprint(const struct spr_node *tree, FILE *stream)
 {
-	char *s = newick(tree);
-	fputs(s, stream); putc('\n', stream);
-	free(s);
+	spr_newick_write(stream, NULL, tree, NULL, NULL);
+	putc('\n', stream);
 }
 
 
@@ -52,32 +52,33 @@ unsigned int lcg(struct lcg *lcgp) {
  *  but it will waste half the space.  (AMD64 int=32bits, though)
  */
 
-static unsigned int sieved = 0, maxptest = 0;
-static unsigned int *primeset = NULL;
+/* The sieve lives in the spr_context.  A context from spr_context_new() is
+ * sieved once, up front, and is read-only after that: is_prime falls back to
+ * trial division rather than growing it, so threads can share it. */
 
-#define is_prime_macro(p)	((primeset[(p)>>6]>>(((p)>>1)&31))&1)
-#define exclude_macro(p)	( primeset[(p)>>6] &= ((-1) ^ (1<<(((p)>>1)&31))) )
+#define is_prime_macro(primeset, p)	((primeset[(p)>>6]>>(((p)>>1)&31))&1)
+#define exclude_macro(primeset, p)	( primeset[(p)>>6] &= ((-1) ^ (1U<<(((p)>>1)&31))) )
 
 /* can't easily be grown; easiest to re-sieve from 0 every time it has to grow
  * could change inner loop (over n) to start low*low+m (where m makes it a
  * multiple of i)...  too much work.
  */
-static void sieve(unsigned int sqrthigh){
+static void sieve(unsigned int *primeset, unsigned int sqrthigh){
 	unsigned int n,i;
 	unsigned int high = sqrthigh*sqrthigh;
 
 	memset(primeset, -1, sizeof(*primeset) * (1 + (high>>6)));
 //	for (i=0 ; i < (high>>6) ; primeset[i++] = -1 );
 	for (i=3 ; i <= sqrthigh ; i += 2){
-		if (is_prime_macro(i)){
+		if (is_prime_macro(primeset, i)){
 			for (n=i*i ; n <= high ; n+=2*i){
-				exclude_macro(n);
+				exclude_macro(primeset, n);
 			}
 		}
 	}
 }
 
-static void primesetup(int k){
+static void primesetup(struct spr_context *ctx, int k){
 	int sqrsize = (int)ceilf(sqrtf(k));
 	if (sqrsize & 0xffff0000){ // Could be relaxed with 64bit int
 		fprintf(stderr, "allspr error: lcg: max prime too big: 0x%x\n", sqrsize);
@@ -86,30 +87,35 @@ static void primesetup(int k){
 
 	sqrsize = max(21, sqrsize); // for allspr, just go big the first time
 
-	if (sqrsize > sieved){
-		primeset = xrealloc(primeset, sizeof(*primeset) *
+	if (sqrsize > ctx->sieved){
+		ctx->primeset = xrealloc(ctx->primeset, sizeof(*ctx->primeset) *
 				    (((sqrsize*sqrsize)>>6) + 1) );
-		sieve(sqrsize);
-		sieved = sqrsize;
-		maxptest = sieved * sieved;
+		sieve(ctx->primeset, sqrsize);
+		ctx->sieved = sqrsize;
+		ctx->maxptest = ctx->sieved * ctx->sieved;
 	}
 }
 
-static inline int is_prime(int p){
-	if (p > maxptest){
-		int old = maxptest;
-		primesetup(p*2);
-		if (spr_debug>=1)
-			fprintf(stderr, "spr debug: sieving more primes. old max %u, new %u\n", old, maxptest);
+static inline int is_prime(struct spr_context *ctx, int p){
+	if (p > ctx->maxptest){
+		if (ctx->fixed){
+			for (int i=3 ; i*i <= p ; i+=2)
+				if (p%i == 0) return FALSE;
+			return p==2 || (p>1 && p&1);
+		}
+		int old = ctx->maxptest;
+		primesetup(ctx, p*2);
+		if (ctx->debug>=1)
+			fprintf(stderr, "spr debug: sieving more primes. old max %u, new %u\n", old, ctx->maxptest);
 	}
-	return p>1 && (p==2 || (p & is_prime_macro(p)));
+	return p>1 && (p==2 || (p & is_prime_macro(ctx->primeset, p)));
 }
 
-static inline int next_prime (int i)
+static inline int next_prime (struct spr_context *ctx, int i)
 {
 	if (i<=2) return 2;
 	i |= 1;			// make i odd
-	while (!is_prime(i)) i+=2;
+	while (!is_prime(ctx, i)) i+=2;
 
 	return i;
 }
@@ -134,24 +140,30 @@ static inline int next_prime (int i)
  * Numerical recipies suggests c = a prime close to (1/2 - sqrt(3)/6)*m
  */
 
+/* make the sieve big enough for findlcg(ctx, ..., maxval) */
+void spr_lcg_setup(struct spr_context *ctx, int maxval)
+{
+	primesetup (ctx, maxval+maxval/2);
+}
+
 /* make up some parameters for an LCG that will have the maximum period
  * equal to the range, so every value is generated once.
  * When maxval doesn't have any repeated prime factors, a = m+1,
  * which is the same as a=1.  It's not exactly random, but it does still
  * mix up which SPRs are done.
  *
- * TODO: take advantage of the fact that maxval = floor(sqrt(maxval))*ceil(sqrt(maxval))
- *  could do that, but then the code would be less general-purpose
- * successfully brute-force tested for maxval=1..1000.
+ * maxval is the number of legal moves of one topology, so it can be
+ * anything, not just n(n-1).
+ * successfully brute-force tested for maxval=1..20000.
  */
-void findlcg(struct lcg *lcg_params, int maxval)
+static void lcgparams(struct spr_context *ctx, struct lcg *lcg_params, int maxval)
 {
 	unsigned int a, b, c, m = maxval;
 	int i;
 
-	primesetup (maxval+maxval/2);
+	if (!ctx->fixed) spr_lcg_setup(ctx, maxval);
 
-	if (m<=6){ // will be either 6 or 2.  Just loop in order
+	if (m<=6){ // too few moves to be worth mixing up.  Just loop in order
 		b=0;
 		c=1;
 	}else{
@@ -161,12 +173,14 @@ void findlcg(struct lcg *lcg_params, int maxval)
 			b=2;
 			while (divlimit%2 == 0) divlimit /= 2;
 		}
-		for (i=3 ; i <= divlimit ; i+=2){
-			if (is_prime(i) && m%i == 0){
+		// factors come out smallest first, so each i that divides is prime
+		for (i=3 ; i*i <= divlimit ; i+=2){
+			if (divlimit%i == 0){
 				b *= i;
 				while (divlimit%i == 0) divlimit /= i;
 			}
 		}
+		if (divlimit > 1) b *= divlimit;  // the one prime factor > sqrt
 
 		if (!(m%4)){	// if m is a mult of 4, b must be.
 			while (b%4) b *= 2;
@@ -180,8 +194,8 @@ void findlcg(struct lcg *lcg_params, int maxval)
 // Numerical Recipies says there is "lore" behind this... :)
 // TAOCP says it's useless unless the multiplier sucks (section 3.3.3, eq. 40)
 // That would be us.
-		c = next_prime(max(5, (0.5 - sqrtf(3)/6.0)*m - 2));
-		while (m%c == 0) c = next_prime(c+1);
+		c = next_prime(ctx, max(5, (0.5 - sqrtf(3)/6.0)*m - 2));
+		while (m%c == 0) c = next_prime(ctx, c+1);
 		// Luckily we don't have to test for c>m, because it doesn't
 		// happen with any m<100, and there are enough primes later...
 /* I've observed that when a == m, (e.g. a=13, c=13, m=72) you often get
@@ -201,7 +215,14 @@ void findlcg(struct lcg *lcg_params, int maxval)
 	lcg_params->c = c;
 	lcg_params->m = m;
 	lcg_params->startstate = UINT_MAX;
-	lcg_params->state = rand() % m;
+}
+
+/* initno picks the start state: a different one for each tree, without any
+ * shared mutable RNG state */
+void findlcg(struct spr_context *ctx, struct lcg *lcg_params, int maxval, unsigned long initno)
+{
+	lcgparams(ctx, lcg_params, maxval);
+	lcg_params->state = mix64(ctx->seed + initno) % lcg_params->m;
 }
 
 
@@ -249,9 +270,23 @@ int main (int argc, char *argv[])
 }
 #endif
 
-void spr_lcg_staticfree(void)
+/* new parameters for a different range, carrying on from the old state */
+void spr_lcg_resize(struct spr_context *ctx, struct lcg *lcg_params, int maxval)
+{
+	unsigned int state = lcg_params->state;
+	lcgparams(ctx, lcg_params, maxval);
+	lcg_params->state = state % lcg_params->m;
+}
+
+void spr_seed( struct spr_tree *tree, unsigned long long seed )
+{
+	tree->lcg.state = mix64(seed) % tree->lcg.m;
+	tree->lcg.startstate = UINT_MAX;
+}
+
+void spr_lcg_ctxfree(struct spr_context *ctx)
 {
-	sieved = 0;
-	free( primeset );
-	primeset = NULL;
+	ctx->sieved = ctx->maxptest = 0;
+	free( ctx->primeset );
+	ctx->primeset = NULL;
 }
@@ -0,0 +1,112 @@
+/* subtree pruning-regrafting (spr) library
+ * Peter Cordes <peter@cordes.ca>, Dalhousie University
+ * license: GPLv2 or later
+ */
+
+/* parallel enumeration of the SPR neighbourhood of one tree.
+ * Each worker thread gets a private copy of the topology (sharing ->data
+ * pointers), a shard of the coded sprnum space, and the caller's dup set.
+ * The workers only read the shared spr_context, and the dup set does its own
+ * locking, so nothing else needs to be synchronized.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define SPR_PRIVATE
+#include "spr.h"
+
+struct spr_worker{
+	struct spr_tree *tree;
+	pthread_t thread;
+	int found;
+	int (*fn)(struct spr_tree *, int, void *);
+	void *arg;
+	volatile int *stop;
+	const int *map;	// worker node number -> the caller's tree's
+};
+
+/* A copy's nodes are numbered in the preorder of the tree it was copied
+ * from, but once an SPR has been applied to that tree, its own numbering is
+ * still the preorder of its original start tree.  So sprnums get translated. */
+static int mapspr( const struct spr_worker *w, int sprnum )
+{
+	return spr_mapsprnum(w->map, w->tree->nodes, sprnum);
+}
+
+static void *worker_main( void *p )
+{
+	struct spr_worker *w = p;
+	int sprnum;
+
+	while (!*w->stop && (sprnum = spr_next_spr(w->tree))){
+		w->found++;
+		if (w->fn && w->fn(w->tree, mapspr(w, sprnum), w->arg))
+			*w->stop = TRUE;
+	}
+	return NULL;
+}
+
+int spr_parallel_neighbours( struct spr_tree *tree, int nthreads,
+	int (*fn)(struct spr_tree *worker, int sprnum, void *arg), void *arg )
+{
+	struct spr_worker *w;
+	struct spr_arena copies;	// every worker's tree, side by side
+	volatile int stop = FALSE;
+	int i, found = 0, *map, nshards = max(tree->nshards, 1);
+	const struct spr_node *p, *prev;
+
+	if (nthreads < 1) nthreads = 1;
+	w = xcalloc(nthreads, sizeof(*w));
+	spr_backtostart(tree);
+	spr_arena_init(&copies, 0);
+
+	// the copies' node i is the i-th in tree's preorder
+	map = xmalloc(tree->nodes * sizeof(*map));
+	for (i=0, p=tree->root, prev=NULL ; ; ){
+		if (prev == p->parent){
+			map[i++] = spr_nodeindex(tree, p);
+			if (p->left){ prev = p; p = p->left; continue; }
+		}else if (prev == p->left){
+			prev = p; p = p->right;
+			continue;
+		}
+		if (p == tree->root) break;
+		prev = p; p = p->parent;
+	}
+
+	/* A copy has the same shape, so spr_init numbers its nodes the same way,
+	 * and sprnums mean the same thing on every copy. */
+	for (i=0 ; i<nthreads ; i++){
+		w[i].tree = spr_init_ctx(tree->ctx, spr_copytree_in(&copies, tree->root), NULL, TRUE);
+		assert( w[i].tree && w[i].tree->nodes == tree->nodes );
+		if (tree->dups) spr_dupset_attach(w[i].tree, tree->dups); // same taxa, can't fail
+		/* a slice of tree's own shard, if it has one.  That's in tree's
+		 * numbering, so the copies test shards on translated sprnums. */
+		spr_setshard(w[i].tree, (nshards > 1 ? tree->shard : 0) + nshards*i, nshards*nthreads);
+		w[i].tree->shardmap = map;
+		w[i].fn = fn;
+		w[i].arg = arg;
+		w[i].stop = &stop;
+		w[i].map = map;
+	}
+
+	for (i=0 ; i<nthreads ; i++)
+		if (pthread_create(&w[i].thread, NULL, worker_main, &w[i])){
+			perror("allspr: creating worker thread");
+			exit(2);
+		}
+	for (i=0 ; i<nthreads ; i++){
+		pthread_join(w[i].thread, NULL);
+		found += w[i].found;
+		if (tree->stats) spr_stats_add(tree->stats, w[i].tree->stats);
+		spr_statefree(w[i].tree);
+	}
+	spr_treefree_arena(&copies);
+	free(map);
+	free(w);
+	return found;
+}
@@ -0,0 +1,198 @@
+/* subtree pruning-regrafting (spr) library
+ * Peter Cordes <peter@cordes.ca>, Dalhousie University
+ * license: GPLv2 or later
+ */
+
+/* multi-start search: many brontler-style chains on a work-stealing pool.
+ * A task is one iteration of one chain.  When a worker finishes an iteration
+ * it pushes the chain's next one onto the bottom of its own deque, so a chain
+ * tends to stay on one thread (its tree stays in that core's cache).
+ * A worker with an empty deque steals from the top of another's.
+ * Every chain is in at most one deque at a time, so each deque can hold them all.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#define SPR_PRIVATE
+#include "spr.h"
+
+struct deque{
+	pthread_mutex_t lock;
+	int *tasks;	// chain indices, circular
+	int head, count;
+};
+
+struct search{
+	struct spr_chain *chains;
+	int nchains;
+	const struct spr_searchopts *opts;
+	struct deque *q;
+	int nthreads;
+	long total;	// topologies found by all chains.  atomic
+	int running;	// chains not finished.  atomic
+};
+
+struct searchworker{
+	struct search *s;
+	int id;
+	pthread_t thread;
+};
+
+static void push(struct search *s, struct deque *d, int chain)
+{
+	pthread_mutex_lock(&d->lock);
+	d->tasks[(d->head + d->count++) % s->nchains] = chain;
+	pthread_mutex_unlock(&d->lock);
+}
+
+// bottom (newest) for the owner, top (oldest) for thieves.  -1 if empty
+static int pop(struct search *s, struct deque *d, int steal)
+{
+	int chain = -1;
+	pthread_mutex_lock(&d->lock);
+	if (d->count){
+		if (steal){
+			chain = d->tasks[d->head];
+			d->head = (d->head + 1) % s->nchains;
+		}else
+			chain = d->tasks[(d->head + d->count - 1) % s->nchains];
+		d->count--;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return chain;
+}
+
+static unsigned long long xorshift(unsigned long long *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+/* one iteration of chain c.  returns TRUE if the chain should go on. */
+static int chain_step(struct search *s, int c)
+{
+	struct spr_chain *ch = &s->chains[c];
+	const struct spr_searchopts *o = s->opts;
+	int sprnum, bestspr = 0, tmp;
+
+	ch->iterations++;
+	while ((sprnum = spr_next_spr(ch->tree))){
+		if (o->topolimit && __sync_fetch_and_add(&s->total, 1) >= o->topolimit)
+			return FALSE;	// over budget: don't report it
+		if (!o->topolimit) __sync_fetch_and_add(&s->total, 1);
+		ch->found++;
+		if (o->fn) o->fn(ch->tree, c, ch->iterations, sprnum, o->arg);
+		bestspr = sprnum;
+		if (o->mode == 2 && (xorshift(&ch->rng) & 1)) break;
+	}
+
+	if (o->mode < 1 || !bestspr)
+		return FALSE;
+	if (o->topolimit && __atomic_load_n(&s->total, __ATOMIC_RELAXED) >= o->topolimit)
+		return FALSE;
+	tmp = spr_apply_sprnum(ch->tree, bestspr);
+	assert( tmp /* spr_apply_sprnum should always succeed */ );
+	return TRUE;
+}
+
+static void *search_main(void *p)
+{
+	struct searchworker *w = p;
+	struct search *s = w->s;
+	int c, i;
+
+	while (__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)){
+		c = pop(s, &s->q[w->id], FALSE);
+		for (i=1 ; c < 0 && i < s->nthreads ; i++)
+			c = pop(s, &s->q[(w->id + i) % s->nthreads], TRUE);
+		if (c < 0){ // everything left is being run by someone else
+			sched_yield();
+			continue;
+		}
+		if (chain_step(s, c))
+			push(s, &s->q[w->id], c);
+		else
+			__sync_fetch_and_sub(&s->running, 1);
+	}
+	return NULL;
+}
+
+long spr_search_run( struct spr_chain *chains, int nchains, const struct spr_searchopts *opts )
+{
+	struct search s = { chains, nchains, opts, NULL, opts->nthreads, 0, nchains };
+	struct searchworker *w;
+	struct spr_dupset *shared = NULL;
+	struct spr_arena copies;	// the chains' trees
+	int i, ok = TRUE;
+
+	if (s.nthreads < 1) s.nthreads = 1;
+	if (nchains < 1) return 0;
+
+	/* Set up all the trees here, so workers never call spr_init: the default
+	 * context's tables only grow in spr_init, and the rest of the library
+	 * just reads them. */
+	spr_arena_init(&copies, 0);
+	for (i=0 ; i<nchains ; i++){
+		struct spr_chain *ch = &chains[i];
+		ch->tree = spr_init(spr_copytree_in(&copies, ch->start), NULL, opts->shared_visited && i > 0);
+		if (!ch->tree){
+			fputs("allspr: couldn't init a search chain\n", stderr);
+			exit(2);
+		}
+		spr_seed(ch->tree, ch->seed);
+		ch->rng = ch->seed | 1;  // xorshift state must be non-zero
+		ch->iterations = 0;
+		ch->found = 0;
+		if (opts->shared_visited){
+			if (i == 0) shared = ch->tree->dups;
+			else if (!spr_dupset_attach(ch->tree, shared)) ok = FALSE;
+			else spr_add_dup(ch->tree, ch->tree->root); // its start tree
+		}
+	}
+
+	if (ok){
+		s.q = xcalloc(s.nthreads, sizeof(*s.q));
+		w = xcalloc(s.nthreads, sizeof(*w));
+		for (i=0 ; i<s.nthreads ; i++){
+			pthread_mutex_init(&s.q[i].lock, NULL);
+			s.q[i].tasks = xmalloc(nchains * sizeof(int));
+		}
+		for (i=0 ; i<nchains ; i++)  // deal the chains out
+			push(&s, &s.q[i % s.nthreads], i);
+
+		for (i=0 ; i<s.nthreads ; i++){
+			w[i].s = &s;
+			w[i].id = i;
+			if (pthread_create(&w[i].thread, NULL, search_main, &w[i])){
+				perror("allspr: creating search thread");
+				exit(2);
+			}
+		}
+		for (i=0 ; i<s.nthreads ; i++)
+			pthread_join(w[i].thread, NULL);
+
+		for (i=0 ; i<s.nthreads ; i++){
+			pthread_mutex_destroy(&s.q[i].lock);
+			free(s.q[i].tasks);
+		}
+		free(s.q);
+		free(w);
+	}
+
+	for (i=0 ; i<nchains ; i++){
+		if (opts->stats && chains[i].tree->stats)
+			spr_stats_add(opts->stats, chains[i].tree->stats);
+		spr_statefree(chains[i].tree);
+		chains[i].tree = NULL;
+	}
+	spr_treefree_arena(&copies);
+	if (!ok) return -1;
+	return (opts->topolimit && s.total > opts->topolimit) ? opts->topolimit : s.total;
+}
@@ -23,20 +23,23 @@ void inorder(const struct spr_node *p, void (*func)(const struct spr_node *))
 	if (p->right) inorder(p->right, func);
 }
 
+// nodes aren't contiguous, so go through nodelist.  NULL if not found
 struct spr_node *spr_treesearchbyname( struct spr_tree *t, const char *s )
 {
-	struct spr_node *p, *array = t->nodelist[0];
-	for( p=array ; p < array+t->nodes && 0!=strcmp(s,p->data->name) ; p++ );
-	return p;
-//	return spr_searchbyname(t->root, s);
+	int i;
+	for (i=0 ; i < t->nodes ; i++)
+		if (0 == strcmp(s, t->nodelist[i]->data->name))
+			return t->nodelist[i];
+	return NULL;
 }
 
 struct spr_node *spr_treesearch( struct spr_tree *t, const struct spr_node *query )
 {
-	struct spr_node *p, *array = t->nodelist[0];
-	for( p=array ; p < array+t->nodes && p != query ; p++ );
-	return p;
-//	return spr_search(t->root, query);
+	int i;
+	for (i=0 ; i < t->nodes ; i++)
+		if (t->nodelist[i] == query)
+			return t->nodelist[i];
+	return NULL;
 }
 
 /* can't count on tree being sorted by name, so search it all */
@@ -79,6 +82,24 @@ struct spr_node *spr_searchbypointer( struct spr_node *tree, const void *query )
 	return NULL;
 }
 
+int spr_nodeindex( const struct spr_tree *t, const struct spr_node *p )
+{
+	int i, mask = t->nodeidxsize - 1;
+	for (i = mix64((size_t)p) & mask ; t->nodeidx[i].node ; i = (i+1) & mask)
+		if (t->nodeidx[i].node == p) return t->nodeidx[i].idx;
+	return -1;
+}
+
+const unsigned long long *spr_clade( const struct spr_tree *t, const struct spr_node *p )
+{
+	return t->clades + (size_t)spr_nodeindex(t, p) * t->cladewords;
+}
+
+static inline unsigned long long *cladeof( struct spr_tree *t, const struct spr_node *p )
+{
+	return t->clades + (size_t)spr_nodeindex(t, p) * t->cladewords;
+}
+
 int spr_countnodes( const struct spr_node *p )
 {
 	if (p->left)
@@ -99,22 +120,11 @@ int spr_isancestor( const struct spr_node *ancestor, const struct spr_node *p )
 }
 
 
-/******** dospr: the real SPR function at the heart of the library ********/
-/* reattach src (and it's parent node, which would otherwise have to be deleted)
- * to the branch between dest and its parent.  This makes src and dest siblings.
- * return success/fail
- * Only SPRs which would actually break the tree are rejected here.  see spr()
- */
-static int dospr( struct spr_node *src, struct spr_node *dest )
+/* the pointer surgery for dospr(), without the checks or bookkeeping */
+static void regraft( struct spr_node *src, struct spr_node *dest )
 {
-	// FIXME: use the callback
 	struct spr_node *sp = src->parent, *dp = dest->parent;
 
-	if (spr_isancestor(src, dest) || // dest inside the subtree being pruned
-	    dest == sp)		// src parent goes with src, so can't be dest
-		return FALSE;
-	assert( src->parent != NULL /* isancestor should have caught src==root */ );
-
 	// This can result in dest->parent having two pointers to sp,
 	// resulting in getting the mirror image unspr, for example with cox2
 	// spr number 68 (int2->cox2_trybb), because isrightchild will be true!
@@ -132,54 +142,184 @@ static int dospr( struct spr_node *src, struct spr_node *dest )
 	}
 
 	sp->parent = dp;
+}
+/* preorder intervals: q is in p's subtree iff pre[p] <= pre[q] < end[p].
+ * Nodes are numbered by their index in A, or tree->nodelist if A is NULL.
+ * order (if not NULL) gets the node at each preorder position.
+ * Walks the tree with parent pointers, so no recursion. */
+static void intervals( const struct spr_tree *t, const struct spr_node *A, const struct spr_node *root,
+	int *pre, int *end, int *order )
+{
+	const struct spr_node *p = root, *prev = NULL, *next;
+	int i, pos = 0;
+	while (p){
+		i = A ? p-A : spr_nodeindex(t, p);
+		if (prev == p->parent){  // coming down
+			if (order) order[pos] = i;
+			pre[i] = pos++;
+			if (p->left) next = p->left;
+			else{ end[i] = pos; next = p->parent; }
+		}else if (prev == p->left)
+			next = p->right;
+		else{
+			end[i] = pos;
+			next = p->parent;
+		}
+		prev = p;
+		p = next;
+	}
+}
+
+
+/******** dospr: the real SPR function at the heart of the library ********/
+/* reattach src (and it's parent node, which would otherwise have to be deleted)
+ * to the branch between dest and its parent.  This makes src and dest siblings.
+ * return success/fail
+ * Only SPRs which would actually break the tree are rejected here.  see spr()
+ */
+static int dospr( struct spr_tree *tree, struct spr_node *src, struct spr_node *dest )
+{
+	// FIXME: use the callback
+	struct spr_node *sp = src->parent, *dp = dest->parent, *q;
+	const int w = tree->cladewords;
+	const unsigned long long *sc;
+	unsigned long long *c;
+	int k;
+
+	if (spr_isancestor(src, dest)){ // dest inside the subtree being pruned
+		SPR_COUNT(tree, reject_ancestor);
+		return FALSE;
+	}
+	if (dest == sp){	// src parent goes with src, so can't be dest
+		SPR_COUNT(tree, reject_sibling);
+		return FALSE;
+	}
+	assert( src->parent != NULL /* isancestor should have caught src==root */ );
+
+	// only clades on the path from the prune point to the root lose src's taxa
+	sc = cladeof(tree, src);
+	for (q = sp->parent ; q ; q = q->parent)
+		for (c = cladeof(tree, q), k=0 ; k<w ; k++) c[k] &= ~sc[k];
+
+	regraft(src, dest);
+
+	// and ones on the path from the regraft point gain them
+	c = cladeof(tree, sp);
+	const unsigned long long *dc = cladeof(tree, dest);
+	for (k=0 ; k<w ; k++) c[k] = sc[k] | dc[k];
+	for (q = dp ; q ; q = q->parent)
+		for (c = cladeof(tree, q), k=0 ; k<w ; k++) c[k] |= sc[k];
 	return TRUE;
 }
 
 
+/* the pointer surgery for doupper(), without the checks or bookkeeping.
+ * Turn the path from v down to w upside down: w becomes v's child, in the
+ * place of v's other child, and every other node on the path becomes the
+ * parent of the one that was above it.  The top one gets v's other child. */
+static void reverse( struct spr_node *v, struct spr_node *w )
+{
+	struct spr_node *top = w->parent, *a1, *other, *x, *below, *above, *next, *repl;
+
+	for (a1 = w ; a1->parent != v ; a1 = a1->parent) ;
+	other = v->left == a1 ? v->right : v->left;
+
+	for (below = w, x = top, above = x->parent ; x != v ; below = x, x = above, above = next){
+		next = above->parent;	// read it before it changes
+		repl = above == v ? other : above;
+		if (x->left == below) x->left = repl;
+		else x->right = repl;
+		repl->parent = x;
+		x->parent = below == w ? v : below;
+	}
+	if (v->left == a1){ v->left = top; v->right = w; }
+	else{ v->right = top; v->left = w; }
+	w->parent = v;
+}
+
+/* spr_upper() without the checks.  Only clades on the reversed path change:
+ * each one becomes v's clade minus the old clade of the node below it,
+ * the same way as the path up to a new root. */
+static void doupper( struct spr_tree *tree, struct spr_node *v, struct spr_node *w )
+{
+	struct spr_node *p;
+	const int words = tree->cladewords;
+	unsigned long long *prev = tree->cladework, *old = prev + words, *c;
+	const unsigned long long *all = cladeof(tree, v);
+	int k;
+
+	memcpy(prev, cladeof(tree, w), words * sizeof(*prev));
+	for (p = w->parent ; p != v ; p = p->parent){
+		c = cladeof(tree, p);
+		memcpy(old, c, words * sizeof(*old));
+		for (k=0 ; k<words ; k++) c[k] = all[k] & ~prev[k];
+		memcpy(prev, old, words * sizeof(*prev));
+	}
+	reverse(v, w);
+}
+
+// back to the starting tree, if we're not there
+static int undo( struct spr_tree *tree )
+{
+	int ok = TRUE;
+	if (!tree->unspr_dest) return FALSE;
+	if (tree->unspr_upper)
+		doupper(tree, tree->unspr_src, tree->unspr_dest);
+	else
+		ok = dospr(tree, tree->unspr_src, tree->unspr_dest);
+	SPR_COUNT(tree, unsprs);
+	if (!isroot(tree->root)){
+		tree->root = spr_findroot(tree->unspr_dest);
+		SPR_COUNT(tree, reroots);
+	}
+	if (tree->ctx->debug>=2){
+		fputs("  unspr back to: ", stderr);
+		newickprint(tree->root, stderr);
+	}
+	assert( ok );
+	tree->unspr_dest = NULL;
+	tree->unspr_upper = FALSE;
+	return ok;
+}
+
+
 /* A wrapper around dospr():
  * return the tree to its original topology if needed.
  * rejects some useless SPRs (e.g. that don't change the topology)
  * save info so unspr can get back to original topology.
  * returns TRUE if dospr() succeeds and the tree is modified.
- *
- * It's probably easy to make a mess if you call this directly while root
- * moving is going on. e.g. tree->lastspr is checked for some things.
- * Root moving was hacked in as an afterthought.
  */
-int spr( struct spr_tree *tree, struct spr_node *src, struct spr_node *dest )
+static int checkedspr( struct spr_tree *tree, struct spr_node *src, struct spr_node *dest )
 {
-	int tmp, unspr_success=FALSE;
+	int tmp, unspr_success = undo(tree);
 
-	if (tree->unspr_dest){	// back to starting tree
-		unspr_success = dospr(tree->unspr_src, tree->unspr_dest);
-		tree->root = spr_findroot(tree->unspr_dest);
-		if (spr_debug>=2){
-			fputs("  unspr back to: ", stderr);
-			newickprint(tree->root, stderr);
-		}
-		assert( unspr_success );
-		tree->unspr_dest = NULL;
-	}
 	if (!src && !dest) return unspr_success;
 
 	// We used to exclude dest==root, but it doesn't break unspr or anything.
 	// It always has the same (unrooted) topology as two other trees that spr_next_spr finds.
 	// (the root node is the "extra" node, for unrooted vs. rooted tree) */
-	if ( !src || !dest ||	// protect against silly callers
-	     spr_isancestor(src, dest) || // does this really always catch !(src->parent)?
-	     src->parent == dest->parent)  // don't switch siblings
+	if (!src || !dest)	// protect against silly callers
+		return FALSE;
+	if (spr_isancestor(src, dest)){ // does this really always catch !(src->parent)?
+		SPR_COUNT(tree, reject_ancestor);
+		return FALSE;
+	}
+	if (src->parent == dest->parent){  // don't switch siblings
+		SPR_COUNT(tree, reject_sibling);
 		return FALSE;
+	}
 
 	tree->unspr_src = src;
 	tree->unspr_dest = sibling(src);
 
-	tmp = dospr(src, dest);
+	tmp = dospr(tree, src, dest);
 	if (tmp){
 		if (!isroot(tree->root)){
 			tree->root = spr_findroot(dest);
-			if (spr_debug>=2) fputs("allspr: tree has new root!\n", stderr);
+			SPR_COUNT(tree, reroots);
+			if (tree->ctx->debug>=2) fputs("allspr: tree has new root!\n", stderr);
 		}
-		if (spr_debug>=1)
+		if (tree->ctx->debug>=1)
 			printf("  did spr %s -> %s\n", src->data->name, dest->data->name);
 	}else
 		tree->unspr_dest = NULL;
@@ -187,130 +327,207 @@ int spr( struct spr_tree *tree, struct spr_node *src, struct spr_node *dest )
 	return tmp;
 }
 
-
-/* sort out a tree where nodes' parent pointers are pointing to nodes that are actually their children.
- * borrowed from procov */
-static void spr_organize_tree(struct spr_node *from, struct spr_node *nd)
+// checkedspr, timed for SPR_STATS
+int spr( struct spr_tree *tree, struct spr_node *src, struct spr_node *dest )
 {
-	struct spr_node *p;
-
-	if(isleaf(nd)) return;
-	if(from==nd->left){  p=nd->parent; nd->parent=nd->left;  nd->left =p; }
-	if(from==nd->right){ p=nd->parent; nd->parent=nd->right; nd->right=p; }
-	spr_organize_tree(nd, nd->left);
-	spr_organize_tree(nd, nd->right);
+	SPR_TIMER(t0);
+	int ok = checkedspr(tree, src, dest);
+	SPR_TIMED(tree, spr, t0);
+	return ok;
 }
 
-// insert the root along the branch connecting child to its parent
-static void placeroot(struct spr_tree *tree, struct spr_node *child)
+int spr_upper( struct spr_tree *tree, struct spr_node *v, struct spr_node *w )
 {
-	if(spr_debug>=5){ spr_treedump(tree, stderr); }
-	struct spr_node *r = tree->root;
-	if(!tree->rootsave1){ // only update undo info if we were at the original tree
-		tree->rootsave1 = r->left;
-		tree->rootsave2 = r->right;
-	}
-	r->left ->parent = r->right;  // extract root from old location
-	r->right->parent = r->left;
+	undo(tree);
+	if (!v || !w || w == v || w->parent == v || !spr_isancestor(v, w))
+		return FALSE;
 
-	r->right = child->parent;
-	r->left = child;
-	*meinparent(child) = child->parent = r;
-	// root is in the tree, but branches are pointing strange directions.
-	if(spr_debug>=5){ spr_treedump(tree, stderr);	putc('\n', stderr); }
-	spr_organize_tree(NULL, r);
+	// doing it again from v to v's other child puts everything back
+	tree->unspr_src = v;
+	tree->unspr_dest = spr_isancestor(v->left, w) ? v->right : v->left;
+	tree->unspr_upper = TRUE;
+	doupper(tree, v, w);
+	if (tree->ctx->debug>=1)
+		printf("  did upper spr %s -> %s\n", v->data->name, w->data->name);
+	return TRUE;
 }
 
-// return the tree to it's original state
-static void unrootmove(struct spr_tree *tree)
+void spr_backtostart(struct spr_tree *tree)
 {
-	struct spr_node *root = tree->root, *s1 = tree->rootsave1, *s2 = tree->rootsave2;
-	if(!s1) return;
-	if(s1->parent == root && s2->parent == root){ if(spr_debug>=3)fprintf(stderr, "allspr: something weird probably happened, %s\n", __func__); return; }
-
 	spr_unspr(tree);
-	if(s1->parent == s2) placeroot(tree, s1);
-	else if(s2->parent == s1) placeroot(tree, s2);
-	else assert( FALSE /* two children of old root aren't connected */ );
-	tree->rootsave1 = tree->rootsave2 = NULL;
 }
 
 // decode an SPR number and do it.
 int spr_sprnum(struct spr_tree *tree, int coded_sprnum)
 {
-	int tmp, sprnum;
+	const int n = tree->nodes;
+	int tmp, sprnum, src, dest;
 	if(!coded_sprnum) return FALSE;
-	else if(coded_sprnum>0){ // classic rooted-tree SPRs not spanning the root
+	else if(coded_sprnum>0){ // classic rooted-tree SPRs
 		sprnum = coded_sprnum-1;
-		if(sprnum > tree->lcg.m) return FALSE;
-		if(tree->lastspr < 0) unrootmove(tree);
-		tmp = spr(tree, tree->nodelist[ sprmap(sprnum, 0) ],
-				tree->nodelist[ sprmap(sprnum, 1) ]);
-		return tree->lastspr = tmp ? coded_sprnum : 0;
-	}else{ // root moving
+		if(sprnum >= n*(n-1)) return FALSE;
+		spr_decode(sprnum, &src, &dest);
+		tmp = spr(tree, tree->nodelist[src], tree->nodelist[dest]);
+	}else{ // the pruned part is the one with the root
 		sprnum = (-coded_sprnum)-1;
-		int rootpos = sprnum / (tree->nodes*tree->nodes);
-		if(rootpos >= tree->nodes) return FALSE;
-
-		spr_unspr(tree);
-//		unrootmove(tree);
-		struct spr_node *r = tree->root, *c = tree->nodelist[rootpos];
-//		if(isleaf(c) || r==c) return FALSE;
-		if(r==c) return FALSE; //ROOTMOVE ONLY
-		if(c->parent != r) placeroot(tree, c); // don't repeat ourselves
-
-		sprnum = sprnum % (tree->nodes*tree->nodes);
-		tmp = sprnum % tree->nodes; sprnum /= tree->nodes;
-		tmp = spr(tree, tree->nodelist[tmp], tree->nodelist[sprnum]);
-		tree->lastspr = coded_sprnum; // root is out of place whether we succeed or not
-		return tmp ? coded_sprnum : 0;
+		if(sprnum >= n*n) return FALSE;
+		tmp = spr_upper(tree, tree->nodelist[sprnum / n], tree->nodelist[sprnum % n]);
 	}
+	return tree->lastspr = tmp ? coded_sprnum : 0;
 }
 
 
 /****************** SPR iteration ******************/
 
+/* An unrooted tree with n taxa has 2(n-3)(2n-7) SPR neighbours.  Cutting a
+ * branch and regrafting one side onto a branch of the other side gives a new
+ * tree every time, if the new branch isn't next to the pruned one or one away
+ * from it.  Those one away are NNIs, which four moves each give, so they're
+ * done separately, two per internal branch.
+ * On the rooted tree, the side away from the root is pruned by spr(), and
+ * the side with the root by spr_upper().  The root's two branches are one
+ * unrooted branch, so moves onto it are only counted for dest == the root's
+ * left child.  A node at depth d below another is d-1 branches away from it.
+ */
+
+/* Number the candidate moves of a new start topology, and size the LCG to fit.
+ * A src can go anywhere except its own subtree, its parent and its sibling,
+ * so it has n - size - 2 dests.  The root has none.  Nodes with a parent and
+ * children can spr_upper() to any of their size-1 descendants, except the
+ * root's children: that would be the same as spr() of their sibling.
+ * Only a few of each node's moves (the close ones) aren't canonical(). */
+static void number_moves( struct spr_tree *t )
+{
+	const int n = t->nodes;
+	int *pre = t->movepre, *end = t->moveend, *cum = t->movecum, *up = t->moveupcum, i, q;
+	const struct spr_node *p;
+
+	intervals(t, NULL, t->root, pre, end, t->moveorder);
+	cum[0] = up[0] = 0;
+	for (i=0 ; i<n ; i++){
+		p = t->nodelist[i];
+		if (isroot(p)){
+			t->movepar[i] = t->movesib[i] = -1;
+			cum[i+1] = cum[i];
+			up[i+1] = up[i];
+			continue;
+		}
+		t->movepar[i] = spr_nodeindex(t, p->parent);
+		t->movesib[i] = spr_nodeindex(t, sibling(p));
+		cum[i+1] = cum[i] + n - (end[i] - pre[i]) - 2;
+		up[i+1] = up[i] + (isroot(p->parent) ? 0 : end[i] - pre[i] - 1);
+	}
+	t->movedepth[t->moveorder[0]] = 0;
+	for (q=1 ; q<n ; q++)  // parents come first in preorder
+		t->movedepth[t->moveorder[q]] = 1 + t->movedepth[t->movepar[t->moveorder[q]]];
+	spr_lcg_resize(t->ctx, &t->lcg, cum[n] + up[n]); // the primes were sized in spr_init
+}
+
+// v such that cum[v] <= rank < cum[v+1]
+static int findsrc( const int *cum, int n, int rank )
+{
+	int lo = 0, hi = n, mid;
+	while (hi - lo > 1){  // cum[lo] <= rank < cum[hi]
+		mid = (lo + hi) / 2;
+		if (cum[mid] <= rank) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* Is spr(v, d) of the start topology the one that counts for its unrooted
+ * tree?  d must be a legal dest for v.  sp is suppressed when v is pruned,
+ * so sib's branch and sp's branch become the one v came from. */
+static int canonical( const struct spr_tree *t, int v, int d )
+{
+	const int *pre = t->movepre, *end = t->moveend, *depth = t->movedepth;
+	const int root = t->moveorder[0], L = t->moveorder[1], R = t->movesib[L];
+	int sp = t->movepar[v], sib = t->movesib[v], gp, uncle;
+
+	if (sp == root)	// the root's other child is suppressed too: d is below it
+		return depth[d] - depth[sib] >= 3;
+	if (pre[sib] <= pre[d] && pre[d] < end[sib])
+		return depth[d] - depth[sib] >= 2;
+
+	gp = t->movepar[sp];
+	uncle = t->movesib[sp];
+	if (gp == root){ // the root's branches are part of the one v came from
+		if (pre[d] < pre[uncle] || pre[d] >= end[uncle]) return FALSE;
+		return depth[d] - depth[uncle] >= 2 ||
+			// the NNIs across the root's branch(es): swap with R's left child
+			(sp == L && end[uncle] - pre[uncle] > 1 && d == t->moveorder[pre[uncle]+1]);
+	}
+	if (d == uncle) return TRUE;	// the NNIs across the branch above sp
+	return d != gp && d != root && d != R &&
+		!(d == L && t->movepar[gp] == root); // gp's branch is the root branch
+}
+
+/* coded sprnum of the rank'th candidate move of the start topology,
+ * or 0 if it's not canonical.
+ * For spr(), find the src by binary search on cum, then count through the
+ * preorder positions, stepping over the excluded ones: the parent (always
+ * first), and the src's subtree and its sibling, in whichever order they come.
+ * For spr_upper(), the rest of the ranks are descendants in preorder. */
+static int rank_sprnum( const struct spr_tree *t, int rank )
+{
+	const int n = t->nodes, *cum = t->movecum, *pre = t->movepre;
+	int v, q, a, len, y;
+
+	if (rank >= cum[n]){
+		rank -= cum[n];
+		v = findsrc(t->moveupcum, n, rank);
+		q = t->moveorder[pre[v] + 1 + rank - t->moveupcum[v]];
+		if (t->movedepth[q] - t->movedepth[v] < 3) return 0;
+		return -(1 + v*n + q);
+	}
+	v = findsrc(cum, n, rank);
+	q = rank - cum[v];
+	a = pre[v];
+	len = t->moveend[v] - a;
+	y = pre[t->movesib[v]];
+	if (q >= pre[t->movepar[v]]) q++;
+	if (y < a){
+		if (q >= y) q++;
+		if (q >= a) q += len;
+	}else{
+		if (q >= a) q += len;
+		if (q >= y) q++;
+	}
+	if (!canonical(t, v, t->moveorder[q])) return 0;
+	return 1 + spr_encode(v, t->moveorder[q]);
+}
+
 /* return 0 for all done, else 1+SPR number.  Zero makes a nicer sentinel than
  * UINT_MAX for users of the library, but beware of the offset when debugging.
- *
- * root moving: loop through normal SPRs, then return negative sprnums.
  */
 int spr_next_spr( struct spr_tree *tree )
 {
-	int tmp = FALSE;
-	unsigned sprnum;
-
-//	tree->rootmove=1; //ROOTMOVE ONLY
-	if(tree->rootmove == 0){
-		do{  // try SPRs until we find a legal one, or loop to beginning
-			sprnum = lcg( &tree->lcg );
-			if(UINT_MAX == sprnum) break;
-			tmp = spr_sprnum(tree, sprnum+1);
-			if (tmp && tree->dups)
-				tmp = spr_add_dup(tree, tree->root);
-		}while(!tmp);
-		if(UINT_MAX != sprnum) return 1 + sprnum;
-	}
-#ifdef NO_ROOT_MOVING
-	return FALSE;
-#else
-	do{
-		if(tree->rootmove++ > (tree->nodes*tree->nodes*tree->nodes)) return FALSE;
-		tmp = spr_sprnum(tree, -(int)(tree->rootmove+1));
+	int tmp = FALSE, sprnum = 0;
+	unsigned rank;
+
+	do{  // the LCG only covers legal SPRs, and all but a few per src are canonical
+		rank = lcg( &tree->lcg );
+		if(UINT_MAX == rank) return FALSE;
+		SPR_COUNT(tree, next_tries);
+		sprnum = rank_sprnum(tree, rank);
+		if(!sprnum || !spr_inshard(tree, sprnum)) continue;
+		tmp = spr_sprnum(tree, sprnum);
+		assert( tmp /* number_moves only counts legal SPRs */ );
 		if (tmp && tree->dups)
 			tmp = spr_add_dup(tree, tree->root);
 	}while(!tmp);
-	return tree->lastspr = -(int)(tree->rootmove+1);
-#endif
+	SPR_COUNT(tree, next_found);
+	return sprnum;
 }
 
 /* move to a new tree.  also called from spr_init() */
 void spr_apply(struct spr_tree *tree)
 {
 	tree->unspr_dest = tree->unspr_src = NULL;
+	tree->unspr_upper = FALSE;
 	tree->lcg.startstate = UINT_MAX;
-	tree->rootmove = tree->lastspr = 0;
-	tree->rootsave1 = tree->rootsave2 = NULL;
+	tree->lastspr = 0;
+	number_moves(tree);
 }
 
 int spr_apply_sprnum(struct spr_tree *tree, int sprnum)
@@ -320,3 +537,62 @@ int spr_apply_sprnum(struct spr_tree *tree, int sprnum)
 		spr_apply(tree);
 	return tmp;
 }
+
+
+/****************** move lists ******************/
+
+int spr_moves( const struct spr_tree *tree, struct spr_move *moves, int k, long *cursor )
+{
+	const int n = tree->nodes;
+	const long m = tree->movecum[n] + tree->moveupcum[n];
+	int got = 0, sprnum;
+
+	assert( !tree->unspr_dest /* must be at the start topology */ );
+	while (got < k && *cursor < m){
+		sprnum = rank_sprnum(tree, (*cursor)++);
+		if (!sprnum || !spr_inshard(tree, sprnum)) continue;
+		if (sprnum > 0){
+			spr_decode(sprnum-1, &moves[got].src, &moves[got].dest);
+			moves[got].upper = FALSE;
+		}else{
+			moves[got].src = (-sprnum-1) / n;
+			moves[got].dest = (-sprnum-1) % n;
+			moves[got].upper = TRUE;
+		}
+		moves[got].sprnum = sprnum;
+		got++;
+	}
+	return got;
+}
+
+struct spr_node *spr_materialize( const struct spr_tree *tree, const struct spr_move *m, struct spr_node *A )
+{
+	const struct spr_node *p;
+	int i;
+
+	for (i=0 ; i<tree->nodes ; i++){  // A[i] for nodelist[i]
+		p = tree->nodelist[i];
+		A[i].parent = p->parent ? A + spr_nodeindex(tree, p->parent) : NULL;
+		A[i].left   = p->left   ? A + spr_nodeindex(tree, p->left)   : NULL;
+		A[i].right  = p->right  ? A + spr_nodeindex(tree, p->right)  : NULL;
+		A[i].data = p->data;
+	}
+	if (m->upper)
+		reverse(A + m->src, A + m->dest);
+	else
+		regraft(A + m->src, A + m->dest);
+	return spr_findroot(A + m->dest);
+}
+
+int spr_domove( struct spr_tree *tree, const struct spr_move *m )
+{
+	return spr_sprnum(tree, m->sprnum);
+}
+
+int spr_apply_move( struct spr_tree *tree, const struct spr_move *m )
+{
+	int tmp;
+	if ((tmp = spr_domove(tree, m)))
+		spr_apply(tree);
+	return tmp;
+}
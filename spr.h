@@ -4,6 +4,9 @@
  */
 
 #include <stddef.h>  // size_t
+#include <stdint.h>  // uint32_t
+#include <stdlib.h>  // abs
+#include <math.h>    // sqrt
 
 #define ALLSPR_VERSION "1.3"
 
@@ -59,9 +62,61 @@ struct spr_node{
 	SPR_NODE_DATAPTR_TYPE *data;
 };
 
-struct spr_duplist{
-	struct spr_node *tree;
-	struct spr_duplist *next;
+/* The duplicate list is a hash set keyed on a fingerprint of the unrooted
+ * topology (see dupcheck.c), so a dup check costs O(n) no matter how many
+ * trees are stored.  The destructive sametopo() comparison only runs when two
+ * fingerprints match, to confirm it's not a collision.  Both work on
+ * topologies as arrays of node numbers, not struct spr_node.
+ * fp == 0 marks an empty slot.
+ *
+ * Stored topologies are compact: an array of parent node numbers, uint16_t
+ * (or uint32_t for trees with >= 65535 nodes).  Leaves are numbered by taxon,
+ * internal nodes after that, and the root is its own parent.  For 64bit
+ * pointers that's 16x smaller than a struct spr_node array. */
+struct spr_dupent{
+	unsigned long long fp;
+	void *rec;  // parent array, in the set's arena
+};
+
+// taxa are numbered by ->data pointer, so all trees in a set share taxon keys
+struct spr_taxon{
+	const void *data;
+	int id;
+};
+
+/* block allocator: many small allocations that are only freed all at once */
+struct spr_arena{
+	struct spr_arenablock *blocks;	// newest first
+	char *next, *end;	// free space in the newest block
+	size_t blocksize;
+};
+
+/* One open addressing table of a dup set.  Threads claim empty slots with a
+ * compare-and-swap on fp, then publish rec.  Nothing is ever removed.
+ * Growing the table is the only time a shard makes other threads wait. */
+struct spr_dupshard{
+	struct spr_dupent *table;
+	size_t size;		// a power of 2
+	size_t count;		// slots used or reserved, kept <= size/2.  atomic
+	int active;		// threads using table.  atomic
+	int resizing;		// a thread is waiting to grow table.  atomic
+	unsigned long long *bloom;	// blocked Bloom filter over fp, or NULL.  see spr_dupset_bloom
+	size_t bloomblocks;	// 64-byte blocks, a power of 2
+	char pad[16];		// keep shards on separate cache lines
+};
+#define SPR_DUPSHARDBITS 4	// shard = top bits of the fingerprint
+
+struct spr_dupset{
+	struct spr_dupshard shards[1 << SPR_DUPSHARDBITS];
+	struct spr_taxon *taxa;
+	const void **taxdata;	// taxon number -> ->data pointer
+	int taxsize, ntaxa;	// taxsize is a power of 2
+	int nodes;
+	size_t recsize;		// bytes per stored topology
+	struct spr_arena recs;	// records from detached trees, only freed
+	int refs;		// trees using the set.  freed when it drops to 0
+	int bloombits;		// filter bits per topology a shard can hold, 0 for no filter
+	struct spr_dupstore *store;	// on disk instead of in the shards, or NULL.  see store.c
 };
 
 /* a linear congruential generator is used to generate all integers 
@@ -75,21 +130,99 @@ struct lcg {
 	unsigned int startstate;
 };
 
+/* Library state that isn't per-tree: lookup tables and settings.
+ * A context from spr_context_new() has its tables built once, up front,
+ * and the library never writes to them after that, so trees sharing it can be
+ * used from different threads at the same time without any locking.
+ * spr_init() uses a default context whose tables grow to fit each new tree,
+ * so it isn't safe to call while other threads are using the library. */
+struct spr_context{
+	int debug;		// verbosity level for the library's messages
+	int maxnodes;		// size of tree the tables are good for
+	int fixed;		// tables never grow.  (set by spr_context_new)
+	unsigned long long seed;
+	unsigned long inits;	// count of trees set up, for LCG start states.  atomic
+	unsigned int *primeset;	// bitmap of odd primes, see lcg.c
+	unsigned int sieved, maxptest;
+};
+
+/* Hot-path counters and latency histograms, one set per tree, so threads
+ * never share them.  Only kept when the library is built with -DSPR_STATS
+ * (see the Makefile): otherwise tree->stats is NULL and the hooks compile to
+ * nothing.  Latencies are in TSC cycles on x86, else nanoseconds. */
+#define SPR_HISTBUCKETS 40	// bucket i: 2^i <= latency < 2^(i+1).  bucket 0 has 0 too
+struct spr_hist{
+	unsigned long long count, total, max;
+	unsigned long long bucket[SPR_HISTBUCKETS];
+};
+struct spr_stats{
+	unsigned long long next_tries;	// moves spr_next_spr() drew from its LCG
+	unsigned long long next_found;	// and returned
+	unsigned long long reject_ancestor;	// spr()s refused: dest in src's subtree
+	unsigned long long reject_sibling;	// refused: src and dest already siblings
+	unsigned long long unsprs;	// SPRs undone
+	unsigned long long reroots;	// SPRs and unsprs that moved the root
+	unsigned long long dup_calls;	// spr_add_dup() + spr_find_dup()
+	unsigned long long dup_hits, dup_misses;
+	unsigned long long dup_compares;	// sametopo() runs, after a fingerprint match
+	unsigned long long dup_cherries;	// cherries reduced by them
+	unsigned long long bloom_negatives;	// spr_find_dup misses the filter answered
+	unsigned long long bloom_falsepos;	// filter said maybe, table said no
+	struct spr_hist spr, find_dup, newick;
+};
+
 struct spr_tree{
+	struct spr_context *ctx;
 	struct spr_node *root;
 	struct spr_node **nodelist; // not sorted
 //	struct spr_node **nodesbyname;
 	struct spr_node *unspr_dest;
 	struct spr_node *unspr_src;  // could be an index into nodelist
-	struct spr_duplist *dups;
+	struct spr_dupset *dups;
+	uint32_t *dupwork;		// scratch index arrays for the dup check, see dupcheck.c
+	unsigned long long *duphash;	// nodes scratch clade hashes
+	struct spr_node *dupnodes;	// nodes scratch, for what spr_find_dup returns
+	struct spr_arena duprecs;	// records this tree added, given to the set on detach
+	unsigned long long dupfp;	// fingerprint of the last topology the dup check saw
+	int shard, nshards;	// spr_next_spr only tries coded sprnums == shard mod nshards
+	const int *shardmap;	// of sprnums renumbered by this node map first, or NULL.  see parallel.c
 	void (*callback)(struct spr_node *);  // not implemented
-	struct spr_node *rootsave1, *rootsave2;
-	unsigned int rootmove;
-	struct lcg lcg;
+	int unspr_upper;	// the undo info is for spr_upper(), not spr()
+	struct lcg lcg;		// over the candidate moves of the start topology
+	unsigned long initno;	// which of ctx's LCG start states it gets.  spr_reinit() keeps it
+
+	/* candidate moves of the start topology, numbered for spr_next_spr:
+	 * node i's subtree is preorder positions [pre[i], end[i]),
+	 * srcs 0..i-1 have cum[i] legal dests between them,
+	 * and upcum[i] descendants to spr_upper() to. */
+	int *movepre, *moveend, *moveorder; // moveorder: preorder position -> node
+	int *movepar, *movesib, *movedepth;
+	int *movecum, *moveupcum;	// nodes+1 entries each
 
 	int lastspr;
 	int nodes;
 	int taxa;
+	int capacity;		// nodes the per-node buffers have room for
+	int nodelistsize;
+
+	// node pointer -> nodelist index, see spr_nodeindex()
+	struct spr_nodeidx *nodeidx;
+	int nodeidxsize;	// power of 2
+
+	/* clade bitsets: cladewords 64bit words per node, in nodelist order.
+	 * Built in spr_init, and then only patched along the paths an SPR changes. */
+	unsigned long long *clades;
+	unsigned long long *cladework;	// 2*cladewords scratch
+	struct spr_node **taxonlist;	// bit number -> leaf
+	int cladewords;
+	struct spr_stats *stats;	// NULL unless built with SPR_STATS
+};
+
+struct spr_nodeidx{
+	const struct spr_node *node;
+	int idx;
+	int namelen;	// strlen(node->data->name), for the newick writer
+	int quote;	// the writer has to quote the name
 };
 
 
@@ -104,6 +237,13 @@ struct spr_tree{
 void *xmalloc (size_t s);  // perror and exit on error
 void *xcalloc (size_t n, size_t s);
 void *xrealloc (void *p, size_t n);
+void spr_arena_init(struct spr_arena *a, size_t blocksize);
+void *spr_arena_alloc(struct spr_arena *a, size_t n); // never returns NULL
+void spr_arena_free(struct spr_arena *a); // free all blocks at once
+void spr_arena_reset(struct spr_arena *a); // free everything in it, but keep the memory
+/* move all of from's blocks to to, leaving from empty.  Safe for several
+ * threads to hand off to the same arena at once, if nobody allocates from it. */
+void spr_arena_handoff(struct spr_arena *from, struct spr_arena *to);
 
 
 // Library API stuff
@@ -113,12 +253,26 @@ void *xrealloc (void *p, size_t n);
  * tree, such as number of nodes, a pointer to the root, etc. */
 struct spr_tree *spr_init( struct spr_node *tree, void (*callback)(struct spr_node *), int allow_dups );
 
+/* Same, but with an explicit context.  Trees with separate contexts, or
+ * sharing one from spr_context_new(), can be used from different threads.
+ * Returns NULL if the tree is bigger than the context's maxnodes. */
+struct spr_tree *spr_init_ctx( struct spr_context *ctx, struct spr_node *tree, void (*callback)(struct spr_node *), int allow_dups );
+/* tables for trees of up to maxnodes nodes.  seed picks the order SPRs are tried in. */
+struct spr_context *spr_context_new( int maxnodes, unsigned long long seed );
+void spr_context_free( struct spr_context *ctx ); // after spr_statefree() on its trees
+
+/* Start over on a new tree, reusing p's memory.  FALSE if the tree is no
+ * good, and then p is only good for another spr_reinit or spr_statefree. */
+int spr_reinit( struct spr_tree *p, struct spr_node *tree );
 void spr_statefree( struct spr_tree *p ); /* use _instead_ of free( p ). 
    * frees just the struct spr_tree and related stuff, not the tree itself */
-void spr_staticfree( void ); // free memory internally allocated by the lib
+void spr_staticfree( void ); // free memory allocated by the lib for the default context
 void spr_treefree( struct spr_node *tree, int freenodedata );
 /* traverse the tree, calling free() on all the nodes, and optionally on
  * all the .data pointers, too. */
+void spr_treefree_arena( struct spr_arena *a );
+/* free every tree (and payload) allocated from a, without traversing them.
+ * a can be used again afterwards. */
 
 
 /******** Tree topology ********/
@@ -128,37 +282,329 @@ void spr_treefree( struct spr_node *tree, int freenodedata );
  * Will be undone by the next spr call, because unspr info is saved.
  */
 int spr( struct spr_tree *tree, struct spr_node *src, struct spr_node *dest );
+/* the other half of an unrooted SPR: prune everything outside v's subtree,
+ * and regraft it onto the branch between w and its parent.  w must be in v's
+ * subtree, but not a child of v.  The root doesn't move; the path from v down
+ * to w is turned upside down instead.  Undone by the next spr call, like spr(). */
+int spr_upper( struct spr_tree *tree, struct spr_node *v, struct spr_node *w );
+/* positive sprnums are spr()s, negative ones spr_upper()s */
 int spr_sprnum(struct spr_tree *tree, int sprnum);
-/* return 0 for all done, else a positive or negative SPR number */
+/* Return 0 for all done, else a positive or negative SPR number.
+ * Each unrooted neighbour of the start topology comes up exactly once,
+ * so the dup check is only needed to skip trees seen from other start trees. */
 int spr_next_spr( struct spr_tree *tree );
 /* return the tree to its original topology */
 static inline int spr_unspr(struct spr_tree *tree){ return spr(tree, NULL, NULL); }
+// undo any SPR, back to the tree spr_next_spr started from
+void spr_backtostart(struct spr_tree *tree);
 // make last SPR permanent spr: don't save unspr info.  preserves duplicate checking list.
 // resets the spr_next_spr() iterator.
 void spr_apply(struct spr_tree *tree);
 int spr_apply_sprnum(struct spr_tree *tree, int sprnum);
 
+/******** Move lists ********/
+/* An SPR described without doing it.  Indices are into tree->nodelist.
+ * upper is FALSE for spr(src, dest), TRUE for spr_upper(src, dest). */
+struct spr_move{
+	int src, dest;
+	int upper;
+	int sprnum;	// coded SPR number, like spr_next_spr returns
+};
+
+/* Fill moves[] with up to k SPRs of the tree's start topology, and
+ * return how many.  0 means there are no more.  Start with *cursor = 0.
+ * These are the moves spr_next_spr makes: one per unrooted neighbour.
+ * The tree isn't modified, so several threads can list and materialize moves
+ * of one tree at once, as long as nobody changes it.  It must be at its start
+ * topology: no spr_next_spr() or spr() in progress (see spr_backtostart).
+ * Honours spr_setshard(). */
+int spr_moves( const struct spr_tree *tree, struct spr_move *moves, int k, long *cursor );
+/* Copy the result of a move into A (tree->nodes nodes, with the same ->data
+ * pointers), and return the root of the copy.  The tree isn't modified. */
+struct spr_node *spr_materialize( const struct spr_tree *tree, const struct spr_move *m, struct spr_node *A );
+/* Do a move on the tree itself, from its start topology, like spr_sprnum.
+ * Follow with spr_apply() to keep it, or spr_backtostart() to undo it. */
+int spr_domove( struct spr_tree *tree, const struct spr_move *m );
+int spr_apply_move( struct spr_tree *tree, const struct spr_move *m );
+
 /******** Duplicate checking ********/
 /* add a tree topology to the dup list (copies the tree).
- * ->data pointers in nodes must be unique
+ * ->data pointers in nodes must be unique.  Expected O(n), independent of the
+ * number of stored topologies.
  * return: TRUE if added ok (implies not already present)
  * FALSE if a dup of a tree already there, so not added. */
 int spr_add_dup( struct spr_tree *tree, struct spr_node *root );
 /* pointer to root of dup tree, or NULL if not a dup. */
 struct spr_node *spr_find_dup( struct spr_tree *tree, struct spr_node *root );
 
+/* A dup set can be shared by several trees with the same taxa, e.g. copies of
+ * one tree in different threads.  spr_add_dup() is an atomic check-and-add:
+ * if two threads add the same topology at once, exactly one gets TRUE.
+ * Neither takes a lock, except while part of the set is being resized.
+ * A new set is empty.  It is freed when the last tree using it is detached
+ * (spr_statefree detaches). */
+struct spr_dupset *spr_dupset_new( const struct spr_tree *tree );
+int spr_dupset_attach( struct spr_tree *tree, struct spr_dupset *set ); // replaces tree->dups.  FALSE if taxa differ
+void spr_dupset_detach( struct spr_tree *tree );
+/* empty tree's set, and renumber it for tree's taxa, keeping the memory.
+ * FALSE (and nothing done) if other trees share the set. */
+int spr_dupset_clear( struct spr_tree *tree );
+/* The fingerprint of the last topology spr_add_dup() or spr_find_dup() looked
+ * at, e.g. the one spr_next_spr() just returned.  Equal topologies have equal
+ * fingerprints, if their sets number the taxa the same way: always, for
+ * in-memory sets of trees from the same start tree. */
+static inline unsigned long long spr_fingerprint( const struct spr_tree *tree ){ return tree->dupfp; }
+
+/* Put a Bloom filter of bits bits per topology (0 to remove it) in front of
+ * each shard, so spr_find_dup() can answer most misses without probing the
+ * hash table.  Filters grow with their shards.  spr_add_dup() doesn't use
+ * them, it just keeps them up to date.  Call it before the set is shared.
+ * ~10 bits gives ~1% false positives, which SPR_STATS counts. */
+void spr_dupset_bloom( struct spr_dupset *set, int bits );
+
+/* Keep tree's dup set in the file at path instead of in memory, creating the
+ * file if it doesn't exist.  The file is mmapped, so it can hold more
+ * topologies than fit in RAM, and a later run on trees with the same taxon
+ * names can reopen it and carry on from where this one left off.  Additions
+ * become durable at spr_dupstore_sync(), every 64k topologies, and when the
+ * set is freed; a crash loses at most the ones since then, and never damages
+ * the file.  Call it right after spr_init (any topologies already in the set
+ * are forgotten, and tree's current one is added).  Trees attached to the set
+ * share the store, with a lock around each lookup.  Bloom filters don't
+ * apply, and spr_reinit() goes back to an in-memory set.
+ * FALSE with *err set if the file can't be used, e.g. different taxa. */
+int spr_dupstore_open( struct spr_tree *tree, const char *path, const char **err );
+int spr_dupstore_sync( struct spr_tree *tree );	// FALSE on a write error
+/* Add every topology in the store at path (e.g. from one shard of a run, see
+ * spr_setshard) to tree's dup set, matching taxa by name, and call fn (may be
+ * NULL) on each one that wasn't there yet, as nodes like spr_find_dup's.
+ * Merging every shard's store into one set gives the same set as a single run.
+ * The store is opened read-only and left as it is; one that another process
+ * has open for writing is an error.  Returns how many were new, or -1 with
+ * *err set. */
+long spr_dupset_merge( struct spr_tree *tree, const char *path,
+	void (*fn)(const struct spr_node *root, void *arg), void *arg, const char **err );
+
+/* Only try SPRs with (absolute) coded sprnums == shard mod nshards.
+ * Trees with the same start topology and one shared dup set, one per shard,
+ * find the same unique trees between them as a single tree would.  So do
+ * separate processes, each with its own set, once their sets are merged
+ * (spr_dupset_merge).  spr_parallel_neighbours splits a tree's shard further. */
+static inline void spr_setshard( struct spr_tree *t, int shard, int nshards ){ t->shard = shard; t->nshards = nshards; }
+
+/* restart the spr_next_spr() sequence at a position chosen by seed, so a run
+ * is repeatable no matter what order trees were set up in. */
+void spr_seed( struct spr_tree *tree, unsigned long long seed );
+
+/******** Checkpoints ********/
+/* Save where tree is up to in a file: its topology, the spr_next_spr()
+ * position, and its dup set (or, if that's in a store, spr_dupstore_sync()
+ * it), plus extralen bytes of the caller's own state.  The file is replaced
+ * atomically, so a crash leaves the old one.  Nothing else may be using the
+ * tree or its dup set meanwhile.  FALSE on an I/O error, with errno set. */
+int spr_checkpoint( struct spr_tree *tree, const char *path, const void *extra, size_t extralen );
+/* Put a checkpoint back into a tree fresh from spr_init() (and
+ * spr_dupstore_open(), if the checkpointed one had a store) on the same start
+ * tree.  Everything comes back just as it was, down to which child is on
+ * which side, so spr_next_spr() carries on with the same moves.  FALSE with
+ * *err set if the checkpoint doesn't fit the tree.  If it's truncated in the
+ * dup set, tree is left in between, only good for spr_reinit() or
+ * spr_statefree(). */
+int spr_restore( struct spr_tree *tree, const char *path, void *extra, size_t extralen, const char **err );
+
+/******** Statistics ********/
+/* copy tree's counters to out.  FALSE (and out zeroed) if the library was
+ * built without SPR_STATS.  Counters carry on across spr_reinit. */
+int spr_stats( const struct spr_tree *tree, struct spr_stats *out );
+void spr_stats_reset( struct spr_tree *tree );
+void spr_stats_add( struct spr_stats *to, const struct spr_stats *from );
+
+/******** Parallel enumeration ********/
+/* Find all the SPR neighbours of tree's start topology using nthreads threads,
+ * each with a private copy of the tree and its own shard of the sprnum space,
+ * all sharing tree's dup set (if it has one).  fn is called from the worker
+ * threads, with the worker's tree set to each new neighbour, and the coded
+ * sprnum that works on tree too.  If fn returns non-zero, all the workers stop.
+ * Returns the number of neighbours found.  Trees from the default context
+ * are fine here: the worker copies are all set up before any threads start. */
+int spr_parallel_neighbours( struct spr_tree *tree, int nthreads,
+	int (*fn)(struct spr_tree *worker, int sprnum, void *arg), void *arg );
+
+/******** Multi-start search ********/
+/* Run many brontler-style search chains at once: each chain repeatedly finds
+ * the unique neighbours of its current tree (all of them in mode 1, or until a
+ * coin flip says stop in mode 2), and moves to the last one it found.
+ * A chain stops when it finds no new neighbours, or when the total number of
+ * topologies found by all chains reaches topolimit.
+ * Each chain has its own copy of its start tree.  Chains are run on a pool of
+ * nthreads threads, one iteration per task, and idle threads steal work.
+ * With shared_visited, all chains share one dup set, so they don't re-explore
+ * each other's trees.  That needs every start tree to have the same taxa.
+ */
+struct spr_chain{
+	const struct spr_node *start;	// not modified
+	unsigned long long seed;	// SPR order and mode 2 coin flips
+	// results:
+	int iterations;
+	long found;		// unique topologies this chain found
+	struct spr_tree *tree;	// private, NULL outside spr_search_run()
+	unsigned long long rng;
+};
+
+struct spr_searchopts{
+	int nthreads;
+	int mode;		// 1 or 2, like brontler -m
+	long topolimit;		// 0 for no limit
+	int shared_visited;
+	/* called for each new topology, from the thread running the chain.
+	 * chain is an index into the chains array.  May be NULL */
+	void (*fn)(struct spr_tree *t, int chain, int iteration, int sprnum, void *arg);
+	void *arg;
+	struct spr_stats *stats;	// if not NULL, every chain's spr_stats get added to it
+};
+
+/* returns the total number of topologies found, or -1 if shared_visited is
+ * set but the chains' start trees have different taxa. */
+long spr_search_run( struct spr_chain *chains, int nchains, const struct spr_searchopts *opts );
+
 /******** IO ********/
+/* The newick parser's node payload.  Parsed trees can have a bigger payload
+ * that starts with the same two members, so it works as any
+ * SPR_NODE_DATAPTR_TYPE with a char *name first. */
+struct spr_newickdata{
+	char *name;	// "" if the tree didn't label the node
+	double length;	// of the branch above the node.  < 0 if the tree didn't give one
+};
+/* Taxon names shared by many parsed trees: their leaves point at the
+ * table's copy of the name, so parsing allocates nothing per taxon.  Once
+ * frozen, every tree must have exactly the table's taxa. */
+struct spr_taxonent{
+	char *name;
+	unsigned int len, hash;
+	int seen;	// gen of the last tree it was in
+};
+struct spr_taxontable{
+	struct spr_taxonent *table;
+	int size, ntaxa;	// size is a power of 2
+	int frozen;		// names not in the table are errors.  set it yourself
+	int gen;		// trees parsed with it
+	struct spr_arena names;
+	char *scratch;		// a quoted name without its '' escapes
+	size_t scratchsize;
+};
+void spr_taxontable_init( struct spr_taxontable *tab );
+void spr_taxontable_free( struct spr_taxontable *tab ); // after the trees are done with its names
+
+/* Everything in a parsed tree (nodes, payloads, internal node names) comes
+ * from one arena, so it's freed all at once.  Don't spr_treefree() it.
+ * Parsing another tree into the same struct reuses the arena's memory. */
+struct spr_newicktree{
+	struct spr_node *root;
+	int nodes, taxa;
+	struct spr_taxontable *taxa_table;	// or NULL for names in the arena
+	struct spr_arena arena;
+};
+void spr_newicktree_init( struct spr_newicktree *t, struct spr_taxontable *taxa );
+/* Parse one tree from s into t, replacing what was there, up to its ; or
+ * s[len] or a nul.  Handles quoted labels, internal node labels, branch
+ * lengths and [comments].  Nodes with more than two children (e.g. an
+ * unrooted tree's root) are resolved into binary ones.  Payloads are datasize
+ * bytes, zeroed apart from the spr_newickdata at the front.  *end gets the
+ * offset just past the tree.  On error, returns FALSE with t empty, *err set
+ * to a message, and *end the offset of the problem.  err and end may be NULL. */
+int spr_parse_newick( struct spr_newicktree *t, const char *s, size_t len,
+	size_t datasize, size_t *end, const char **err );
+void spr_newicktree_free( struct spr_newicktree *t );
+
+/* A random rooted binary tree of ntaxa taxa named t1..tN, put into t the
+ * same way spr_parse_newick would (t's taxon table isn't used).  Uniform
+ * gives every rooted topology the same chance.  The same seed always gives
+ * the same tree.  O(n), no recursion.  NULL for a bad ntaxa or model. */
+enum { SPR_TREE_UNIFORM, SPR_TREE_YULE, SPR_TREE_CATERPILLAR, SPR_TREE_BALANCED };
+struct spr_node *spr_randomtree( struct spr_newicktree *t, int ntaxa, int model,
+	unsigned long long seed, size_t datasize );
+int spr_treemodel( const char *name );  // "uniform", "yule", "caterpillar" or "balanced".  -1 if none
+
 char *newick( const struct spr_node *subtree ); // return a malloc()ed string. no bl
+
+/* Caller-owned output buffer for the newick writer.  It only ever grows, so
+ * writing tree after tree into the same one stops allocating once it's big
+ * enough.  Start from a zeroed struct, and spr_newickbuf_free() it when done. */
+struct spr_newickbuf{
+	char *s;	// nul-terminated
+	size_t len, size;
+};
+/* Overwrite b with a newick string for the tree below root, with the ;.
+ * Returns b->len.  If t isn't NULL, root must be in it, and the names'
+ * lengths come from t instead of strlen.  bl (may be NULL) gives the length
+ * of the branch above a node, or < 0 to leave it out. */
+size_t spr_newick_buf( struct spr_newickbuf *b, const struct spr_tree *t, const struct spr_node *root,
+	double (*bl)(const struct spr_node *p, void *arg), void *arg );
+void spr_newickbuf_free( struct spr_newickbuf *b );
+#ifdef BUFSIZ // detect stdio.h
+/* the same, straight to a stream, without allocating anything.  No newline */
+void spr_newick_write( FILE *stream, const struct spr_tree *t, const struct spr_node *root,
+	double (*bl)(const struct spr_node *p, void *arg), void *arg );
+#endif
+
+/* Neighbours of one start tree share almost all of their newick text.  A rope
+ * caches the text of every subtree of the start topology, and puts a
+ * neighbour together from those spans, only writing out the O(depth) nodes
+ * whose subtrees the current move changed.  No branch lengths.
+ * Copies of the start tree (e.g. spr_parallel_neighbours' workers) number
+ * their nodes the same way, so they can use it too, one at a time. */
+struct spr_rope;
+struct spr_rope *spr_rope_new( const struct spr_tree *t );	// t at its start topology
+void spr_rope_reset( struct spr_rope *r, const struct spr_tree *t ); // after spr_apply()
+void spr_rope_free( struct spr_rope *r );
+size_t spr_rope_buf( struct spr_rope *r, const struct spr_tree *t, struct spr_newickbuf *b ); // like spr_newick_buf
+/* one line: prefix (may be NULL), then t's current tree, with writev(2).
+ * Returns FALSE on a write error, with errno set. */
+int spr_rope_writev( struct spr_rope *r, const struct spr_tree *t, int fd, const char *prefix );
+
+/******** Binary neighbour lists ********/
+/* Compact binary neighbour lists: the start tree's newick once, then a
+ * fixed-width record per neighbour.  parent numbers the start topologies: 1
+ * is the first, and each later one is the previous one with the last sprnum
+ * recorded under it applied (like brontler's modes 1 and 2), so replaying
+ * the records with spr_sprnum() and spr_apply_sprnum() gets any tree back.
+ * Host byte order.  Records are gathered into big blocks for write(2). */
+struct spr_binrec{
+	uint32_t parent;
+	int32_t sprnum;
+	uint64_t fp;	// spr_fingerprint(), or 0
+};
+struct spr_binwriter;
+/* Start a list on fd, with t's current tree as the start tree.  One writer
+ * per fd, and callers lock around spr_binwriter_put if they share one.
+ * Both return FALSE on a write error, with errno set. */
+struct spr_binwriter *spr_binwriter_new( int fd, const struct spr_tree *t );
+int spr_binwriter_put( struct spr_binwriter *w, uint32_t parent, int sprnum, unsigned long long fp );
+int spr_binwriter_close( struct spr_binwriter *w ); // flushes and frees, but leaves fd open
+#ifdef BUFSIZ
+struct spr_binreader{
+	FILE *f;
+	char *newick;	// the start tree
+	int nodes, taxa;
+};
+struct spr_binreader *spr_binreader_open( const char *path, const char **err ); // NULL with *err set
+/* 1 for a record, 0 at the end, or -1 for a read error (ferror(r->f)) or a
+ * partial record at the end: the file was cut short. */
+int spr_binreader_next( struct spr_binreader *r, struct spr_binrec *rec );
+void spr_binreader_close( struct spr_binreader *r );
+#endif
+
+/******** IO, continued ********/
 #ifdef BUFSIZ // detect stdio.h.  skip these if we don't have FILE.
-void newickprint(const struct spr_node *subtree, FILE *stream);
+void newickprint(const struct spr_node *subtree, FILE *stream); // with a newline
 void treeprint(const struct spr_node *p, FILE *stream); // in-order traversal
 void spr_treedump(const struct spr_tree *t, FILE *stream); // dump t->nodelist with names for all pointers
+void spr_stats_print(const struct spr_stats *st, FILE *stream); // a few lines of summary
 #endif // stdio
 
 
 /******** Debugging ********/
-int spr_debug;
-static inline void spr_setdebug(int level){ spr_debug=level; }
+void spr_setdebug(int level); // for the default context.  Otherwise set ctx->debug
 void spr_libsprtest(struct spr_tree *state);
 
 /***** internal functions that might be useful  ****/
@@ -168,10 +614,22 @@ static inline struct spr_node *spr_findroot( struct spr_node *p )
 	return p;
 }
 int spr_countnodes( const struct spr_node *p );
+/* index of p in t->nodelist, or -1.  O(1) expected. */
+int spr_nodeindex( const struct spr_tree *t, const struct spr_node *p );
+
+/* Bitset of the taxa below p, in the current topology: t->cladewords
+ * words, with bit i (word i/64, bit i%64) for the leaf spr_taxonnode(t, i).
+ * Kept up to date by every SPR, so reading it is O(1).
+ * A node and its complement give the bipartition for that branch. */
+const unsigned long long *spr_clade( const struct spr_tree *t, const struct spr_node *p );
+static inline struct spr_node *spr_taxonnode( const struct spr_tree *t, int bit ){ return t->taxonlist[bit]; }
 int spr_isancestor( const struct spr_node *ancestor, const struct spr_node *child );
 
 // xmalloc()ed copy of each node, with ->data pointers the same.
 struct spr_node *spr_copytree(const struct spr_node *node);
+/* Same, but the copy is one contiguous block from a, in preorder, and is
+ * freed with everything else in a by spr_treefree_arena(). */
+struct spr_node *spr_copytree_in(struct spr_arena *a, const struct spr_node *node);
 /* Copy a tree to an array, which must be of size >= spr_countnodes(node).
  * Avoids malloc overhead for each node.  Returns # of nodes copied */
 size_t spr_copytoarray(struct spr_node *array, const struct spr_node *root);
@@ -194,6 +652,15 @@ static inline struct spr_node *spr_newnode(struct spr_node *left, struct spr_nod
 	p->data=data;
 	return p;
 }
+/* Same, from an arena.  Payloads can come from spr_arena_alloc() on it too.
+ * Then spr_treefree_arena() frees whole trees at once. */
+static inline struct spr_node *spr_newnode_in(struct spr_arena *a, struct spr_node *left, struct spr_node *right, struct spr_node *parent, void *data)
+{
+	struct spr_node *p = spr_arena_alloc(a, sizeof(*p));
+	p->parent=parent; p->left=left; p->right=right;
+	p->data=data;
+	return p;
+}
 
 
 
@@ -225,12 +692,33 @@ static inline struct spr_node *spr_newnode(struct spr_node *left, struct spr_nod
 
 #ifdef SPR_PRIVATE // intended for internal library use.  might be useful generally
 unsigned int lcg(struct lcg *lcgp);
-void findlcg(struct lcg *lcg_params, int maxval);
-void spr_lcg_staticfree(void);
-
-int (*sprmap_table)[2];
-int sprmapnodes; // number of nodes the map is good for
-static inline int sprmap(int sprnum, int pos){ return sprmap_table[sprnum][pos]; }
+void findlcg(struct spr_context *ctx, struct lcg *lcg_params, int maxval, unsigned long initno);
+void spr_lcg_setup(struct spr_context *ctx, int maxval);
+void spr_lcg_ctxfree(struct spr_context *ctx);
+
+void spr_lcg_resize(struct spr_context *ctx, struct lcg *lcg_params, int maxval);
+int spr_newick_needsquote( const char *name, size_t len );  // has characters the parser splits labels at
+
+/* Positive coded sprnums are 1 + the index of a (src, dest) pair of nodelist
+ * indices in this order (transposed):
+ *  01 0122 012333  src
+ *  10 2201 333012  dest
+ * For each M = 1, 2, ...: (0..M-1, M) then (M, 0..M-1), starting at M*(M-1).
+ * n nodes use indices 0 .. n*(n-1)-1. */
+static inline int spr_encode(int src, int dest){
+	return src < dest ? dest*(dest-1) + src : src*(src-1) + src + dest; }
+static inline void spr_decode(int idx, int *src, int *dest){
+	int M = (1 + sqrt(1 + 4.0*idx)) / 2;
+	while (M*(M-1) > idx) M--;	// in case sqrt rounded up
+	while ((M+1)*M <= idx) M++;
+	idx -= M*(M-1);
+	if (idx < M){ *src = idx; *dest = M; }
+	else{ *src = M; *dest = idx - M; }
+}
+/* Negative ones are -(1 + v*n + w) for spr_upper(v, w).
+ * spr_next_spr's LCG never needs to cover more than this many moves:
+ * n*(n-1) src,dest pairs plus the total depth of the nodes. */
+#define spr_maxmoves(n) ((n)*((n)-1) + (n)*(n)/2)
 
 // node relationship helpers
 #define isleaf(p) (!(p)->left)
@@ -246,4 +734,82 @@ static inline struct spr_node **siblinginparent(const struct spr_node *p){
 	return (isrightchild(p)? &p->parent->left  : &p->parent->right);}
 #define sibling(p) (*siblinginparent(p))
 
+/* splitmix64's finalizer: a cheap, well-mixed 64bit hash */
+static inline unsigned long long mix64( unsigned long long x )
+{
+	x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// dupcheck.c
+void spr_dupset_init(struct spr_tree *tree);
+
+// init.c: recompute every clade bitset from the topology
+void spr_clades_rebuild(struct spr_tree *t);
+#ifdef BUFSIZ
+size_t spr_dupset_count(const struct spr_dupset *set);	// checkpoint.c's dup set I/O
+int spr_dupset_write(const struct spr_dupset *set, FILE *f);
+int spr_dupset_read(struct spr_tree *tree, FILE *f, size_t n);
+#endif
+
+// store.c: the file behind spr_dupstore_open.  Callers hold the lock for next, alloc and insert.
+struct spr_dupstore_cursor{ size_t i; int pending; };
+struct spr_dupstore *spr_dupstore_file( const char *path, int writable, int nodes, int ntaxa,
+	const char *const *names, size_t recsize, const char **err );
+int spr_dupstore_taxon( const struct spr_dupstore *st, const char *name );
+void spr_dupstore_lock( struct spr_dupstore *st );
+void spr_dupstore_unlock( struct spr_dupstore *st );
+const void *spr_dupstore_next( struct spr_dupstore *st, unsigned long long fp, struct spr_dupstore_cursor *c );
+const void *spr_dupstore_each( const struct spr_dupstore *st, uint64_t *i );
+void *spr_dupstore_alloc( struct spr_dupstore *st );
+void spr_dupstore_insert( struct spr_dupstore *st, unsigned long long fp, const void *rec );
+int spr_dupstore_commit( struct spr_dupstore *st );
+unsigned long long spr_dupstore_count( const struct spr_dupstore *st );
+void spr_dupstore_close( struct spr_dupstore *st );
+
+/* a coded sprnum with node i renumbered to map[i] */
+static inline int spr_mapsprnum(const int *map, int n, int coded_sprnum){
+	int src, dest;
+	if (coded_sprnum > 0){
+		spr_decode(coded_sprnum-1, &src, &dest);
+		return 1 + spr_encode(map[src], map[dest]);
+	}
+	src = (-coded_sprnum-1) / n;
+	dest = (-coded_sprnum-1) % n;
+	return -(1 + map[src]*n + map[dest]);
+}
+
+static inline int spr_inshard(const struct spr_tree *t, int coded_sprnum){
+	if (t->nshards <= 1) return TRUE;
+	if (t->shardmap) coded_sprnum = spr_mapsprnum(t->shardmap, t->nodes, coded_sprnum);
+	return (unsigned)abs(coded_sprnum) % t->nshards == t->shard; }
+
+/* stats.c: hooks for the SPR_STATS counters.  t->stats is a pointer, so
+ * functions with a const tree can still count. */
+#ifdef SPR_STATS
+#if !defined(__x86_64__) && !defined(__i386__)
+#include <time.h>
+#endif
+static inline unsigned long long spr_ticks(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+void spr_hist_add(struct spr_hist *h, unsigned long long ticks);
+#define SPR_COUNT(t, field) ((t)->stats->field++)
+#define SPR_COUNTN(t, field, n) ((t)->stats->field += (n))
+#define SPR_TIMER(v) unsigned long long v = spr_ticks()
+#define SPR_TIMED(t, hist, v) do{ if (t) spr_hist_add(&(t)->stats->hist, spr_ticks() - (v)); }while(0)
+#else
+#define SPR_COUNT(t, field) ((void)0)
+#define SPR_COUNTN(t, field, n) ((void)0)
+#define SPR_TIMER(v) ((void)0)
+#define SPR_TIMED(t, hist, v) ((void)0)
+#endif
+
 #endif // SPR_PRIVATE
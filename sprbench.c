@@ -0,0 +1,246 @@
+/* benchmarks for the allspr library, on synthetic trees.
+ * license: GPLv2 or later
+ *
+ * One line per measurement, tab separated:
+ *   shape taxa metric value unit
+ * so runs from different versions can be diffed or loaded into anything.
+ * Lines starting with # are comments.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// like struct spr_newickdata, which spr_randomtree fills in
+struct benchdata{
+	char *name;
+	double length;
+};
+#define SPR_NODE_DATAPTR_TYPE struct benchdata
+#include "spr.h"
+
+const char *usage=
+"usage: sprbench [options]\n"
+"\t-n list\ttree sizes in taxa, comma separated (default 8,16,64,256,1000,5000)\n"
+"\t-s list\tshapes: caterpillar, balanced, yule, uniform (default all of them)\n"
+"\t-t secs\tminimum time for each measurement (default 0.2)\n"
+"\t-S seed\tfor the random trees and SPRs (default 1)\n"
+"\t-b bits\tBloom filter bits per topology in front of spr_find_dup (default 0, none)\n";
+
+static double budget = 0.2;
+static int bloombits = 0;
+static unsigned long long rng = 1;
+
+static unsigned long long xorshift(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void report(const char *shape, int taxa, const char *metric, double value, const char *unit)
+{
+	printf("%s\t%d\t%s\t%.6g\t%s\n", shape, taxa, metric, value, unit);
+	fflush(stdout);
+}
+
+
+/******** synthetic trees ********/
+static const char *shapes_all[] = { "caterpillar", "balanced", "yule", "uniform" };
+
+/******** measurements ********/
+
+static void bench_init(const char *shape, int taxa, struct spr_node *root)
+{
+	double start, t;
+	long reps = 0;
+	spr_statefree(spr_init(root, NULL, TRUE)); // warm up: the LCG tables grow to fit
+	start = now();
+	do{
+		spr_statefree(spr_init(root, NULL, TRUE));
+		reps++;
+	}while ((t = now() - start) < budget);
+	report(shape, taxa, "spr_init", 1e6 * t / reps, "us");
+}
+
+// spr() a random pair, then undo it.  Pairs spr() refuses aren't counted
+static void bench_spr(const char *shape, int taxa, struct spr_tree *tree)
+{
+	struct spr_node *src, *dest;
+	double start = now(), t;
+	long pairs = 0, tries = 0;
+	int i;
+	do{
+		for (i=0 ; i<1000 ; i++){
+			src = tree->nodelist[xorshift() % tree->nodes];
+			dest = tree->nodelist[xorshift() % tree->nodes];
+			if (spr(tree, src, dest)){
+				spr_unspr(tree);
+				pairs++;
+			}
+			tries++;
+		}
+	}while ((t = now() - start) < budget);
+	report(shape, taxa, "spr_unspr_pairs", pairs / t, "per_s");
+	report(shape, taxa, "spr_valid_fraction", (double)pairs / tries, "ratio");
+}
+
+/* neighbours per second.  With a dup set, every neighbour goes into it, and
+ * it's emptied when the neighbourhood runs out. */
+static void bench_next(const char *shape, int taxa, struct spr_node *root, int dups)
+{
+	struct spr_tree *tree = spr_init(root, NULL, !dups);
+	double start = now(), t;
+	long found = 0;
+	int i;
+	do{
+		for (i=0 ; i<1000 ; i++){
+			if (spr_next_spr(tree)){
+				found++;
+				continue;
+			}
+			spr_backtostart(tree);
+			if (dups) spr_reinit(tree, root);
+			else spr_apply(tree);
+		}
+	}while ((t = now() - start) < budget);
+	report(shape, taxa, dups ? "next_spr_dups" : "next_spr", found / t, "per_s");
+	spr_backtostart(tree);
+	spr_statefree(tree);
+}
+
+/* spr_find_dup on random neighbours of the start tree, as the set fills up
+ * with topologies from a mode-1 style walk.  Gives up on the bigger sizes
+ * when filling takes more than 20 times the budget.  With -b, and a library
+ * built with SPR_STATS, also the filter's false positive rate. */
+static void bench_find(const char *shape, int taxa, struct spr_node *root)
+{
+	static const long sizes[] = { 1000, 10000, 100000, 1000000 };
+	struct spr_tree *tree = spr_init(root, NULL, FALSE);
+	struct spr_stats st;
+	struct spr_node *src, *dest;
+	double start = now(), t, t0;
+	long stored = 1, finds, hits;
+	int sprnum, last = 0, i;
+	unsigned s;
+	char metric[64];
+
+	if (bloombits) spr_dupset_bloom(tree->dups, bloombits);
+
+	for (s=0 ; s < sizeof(sizes)/sizeof(*sizes) ; s++){
+		while (stored < sizes[s] && now() - start < 20*budget){
+			if ((sprnum = spr_next_spr(tree))){
+				last = sprnum;
+				stored++;
+			}else if (last){
+				spr_apply_sprnum(tree, last);
+				last = 0;
+			}else
+				break;	// nowhere new to go
+		}
+		if (stored < sizes[s]) break;
+		spr_backtostart(tree);
+
+		spr_stats_reset(tree);
+		t0 = now();
+		finds = hits = 0;
+		do{
+			for (i=0 ; i<100 ; i++){
+				src = tree->nodelist[xorshift() % tree->nodes];
+				dest = tree->nodelist[xorshift() % tree->nodes];
+				if (!spr(tree, src, dest)) continue;
+				hits += !!spr_find_dup(tree, tree->root);
+				spr_unspr(tree);
+				finds++;
+			}
+		}while ((t = now() - t0) < budget);
+		snprintf(metric, sizeof(metric), "find_dup_at_%ld", sizes[s]);
+		report(shape, taxa, metric, 1e9 * t / finds, "ns");
+		snprintf(metric, sizeof(metric), "find_dup_hits_at_%ld", sizes[s]);
+		report(shape, taxa, metric, (double)hits / finds, "ratio");
+		if (spr_stats(tree, &st) && st.bloom_negatives + st.bloom_falsepos){
+			snprintf(metric, sizeof(metric), "bloom_fpr_at_%ld", sizes[s]);
+			report(shape, taxa, metric, (double)st.bloom_falsepos / (st.bloom_negatives + st.bloom_falsepos), "ratio");
+		}
+	}
+	spr_backtostart(tree);
+	spr_statefree(tree);
+}
+
+static void bench_newick(const char *shape, int taxa, struct spr_tree *tree)
+{
+	struct spr_newickbuf b = { NULL, 0, 0 };
+	double start = now(), t;
+	double bytes = 0;
+	int i;
+	do{
+		for (i=0 ; i<10 ; i++)
+			bytes += spr_newick_buf(&b, tree, tree->root, NULL, NULL);
+	}while ((t = now() - start) < budget);
+	report(shape, taxa, "newick", bytes / t / 1e6, "MB_per_s");
+	spr_newickbuf_free(&b);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char *sizes = "8,16,64,256,1000,5000", *shapes = NULL, *s, *tok;
+	struct spr_newicktree gen;
+	unsigned long long seed = 1;
+	const char *shape;
+	unsigned sh;
+	int i, n;
+
+	while ((i = getopt(argc, argv, "hb:n:s:t:S:")) != -1){
+		switch (i){
+		case 'h': fputs(usage, stdout); return 0;
+		case 'b': bloombits = atoi(optarg); break;
+		case 'n': sizes = optarg; break;
+		case 's': shapes = optarg; break;
+		case 't': budget = atof(optarg); break;
+		case 'S': seed = strtoull(optarg, NULL, 0); rng = seed | 1; break;
+		default: fputs(usage, stderr); return 1;
+		}
+	}
+
+	printf("# allspr " ALLSPR_VERSION " sprbench, %g s per measurement\n", budget);
+	printf("# shape\ttaxa\tmetric\tvalue\tunit\n");
+	spr_newicktree_init(&gen, NULL);
+	for (sh=0 ; sh < sizeof(shapes_all)/sizeof(*shapes_all) ; sh++){
+		shape = shapes_all[sh];
+		if (shapes && !strstr(shapes, shape)) continue;
+		s = strdup(sizes);
+		for (tok = strtok(s, ",") ; tok ; tok = strtok(NULL, ",")){
+			struct spr_node *root;
+			struct spr_tree *tree;
+			if ((n = atoi(tok)) < 4){
+				fprintf(stderr, "sprbench: trees need at least 4 taxa, not %s\n", tok);
+				return 1;
+			}
+			root = spr_randomtree(&gen, n, spr_treemodel(shape), seed, sizeof(struct benchdata));
+			bench_init(shape, n, root);
+			tree = spr_init(root, NULL, TRUE);
+			bench_spr(shape, n, tree);
+			bench_newick(shape, n, tree);
+			spr_statefree(tree);
+			bench_next(shape, n, root, FALSE);
+			bench_next(shape, n, root, TRUE);
+			bench_find(shape, n, root);
+		}
+		free(s);
+	}
+	spr_newicktree_free(&gen);
+	spr_staticfree();
+	return 0;
+}
@@ -0,0 +1,132 @@
+/* turn a binary neighbour list (brontler -b) back into trees.
+ * license: GPLv2 or later
+ *
+ * Each record is a coded sprnum of one of the run's start topologies, so we
+ * only need to redo the run's walk from the start tree: apply the last
+ * sprnum of each start topology to get the next one.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// like struct spr_newickdata, which spr_parse_newick fills in
+struct decodedata{
+	char *name;
+	double length;
+};
+#define SPR_NODE_DATAPTR_TYPE struct decodedata
+#include <spr.h>
+
+const char *usage=
+"usage: sprdecode [options] file\n"
+" Print the trees in a brontler -b file, like brontler prints them.\n"
+"\t-r n\tjust print the nth tree\n"
+"\t-c\tcheck each tree against the fingerprint it was recorded with\n"
+"\t-s\tprint the start tree first\n";
+
+int main(int argc, char *argv[])
+{
+	struct spr_newicktree parsed;
+	struct spr_binreader *r;
+	struct spr_binrec rec, last = { 1, 0, 0 };
+	struct spr_tree *tree;
+	const char *err;
+	long n = 0, want = 0, bad = 0;
+	int i, got, check = FALSE, start = FALSE, retval = 0;
+	size_t end;
+
+	while ((i = getopt(argc, argv, "chr:s")) != -1){
+		switch(i){
+		case 'c': check = TRUE; break;
+		case 'h': fputs(usage, stdout); return 0;
+		case 'r':
+			if ((want = atol(optarg)) <= 0){
+				fprintf(stderr, "sprdecode: bad -r %s: trees are numbered from 1\n", optarg);
+				return 1;
+			}
+			break;
+		case 's': start = TRUE; break;
+		default: fputs(usage, stderr); return 1;
+		}
+	}
+	if (optind != argc-1){
+		fputs(usage, stderr);
+		return 1;
+	}
+
+	if (!(r = spr_binreader_open(argv[optind], &err))){
+		fprintf(stderr, "sprdecode: %s: %s\n", argv[optind], err);
+		return 2;
+	}
+	spr_newicktree_init(&parsed, NULL);
+	if (!spr_parse_newick(&parsed, r->newick, strlen(r->newick), sizeof(struct decodedata), &end, &err)){
+		fprintf(stderr, "sprdecode: %s: bad start tree at offset %zu: %s\n", argv[optind], end, err);
+		return 2;
+	}
+	// the dup set only computes fingerprints, so it always has just the start tree
+	if (!(tree = spr_init(parsed.root, NULL, !check)) || tree->nodes != r->nodes){
+		fprintf(stderr, "sprdecode: %s: couldn't init libspr\n", argv[optind]);
+		return 2;
+	}
+	if (start){
+		spr_newick_write(stdout, tree, tree->root, NULL, NULL);
+		putchar('\n');
+	}
+
+	while ((got = spr_binreader_next(r, &rec)) > 0){
+		n++;
+		if (rec.parent != last.parent){
+			if (rec.parent != last.parent + 1 || !last.sprnum || !spr_apply_sprnum(tree, last.sprnum)){
+				fprintf(stderr, "sprdecode: %s: record %ld: tree %u doesn't follow tree %u.%d\n",
+					argv[optind], n, rec.parent, last.parent, last.sprnum);
+				retval = 2;
+				break;
+			}
+		}
+		last = rec;
+		if (want && n != want) continue;
+		if (!spr_sprnum(tree, rec.sprnum)){
+			fprintf(stderr, "sprdecode: %s: record %ld: tree %u.%d is no SPR\n",
+				argv[optind], n, rec.parent, rec.sprnum);
+			retval = 2;
+			break;
+		}
+		if (check && rec.fp){
+			spr_find_dup(tree, tree->root);
+			if (spr_fingerprint(tree) != rec.fp){
+				fprintf(stderr, "sprdecode: record %ld: fingerprint doesn't match\n", n);
+				bad++;
+			}
+		}
+		printf("%ld: tree %u.%d: ", n, rec.parent, rec.sprnum);
+		spr_newick_write(stdout, tree, tree->root, NULL, NULL);
+		putchar('\n');
+		spr_backtostart(tree);
+		if (want) break;
+	}
+	if (got < 0){
+		fprintf(stderr, "sprdecode: %s: after record %ld: %s\n", argv[optind], n,
+			ferror(r->f) ? strerror(errno) : "truncated");
+		retval = 2;
+	}else if (want && n != want){
+		fprintf(stderr, "sprdecode: %s: only %ld trees\n", argv[optind], n);
+		retval = 2;
+	}
+	if (bad){
+		fprintf(stderr, "sprdecode: %ld fingerprints didn't match\n", bad);
+		retval = 2;
+	}
+	if (fflush(stdout)){
+		perror("sprdecode: writing trees");
+		retval = 2;
+	}
+	spr_binreader_close(r);
+	spr_statefree(tree);
+	spr_newicktree_free(&parsed);
+	spr_staticfree();
+	return retval;
+}
@@ -0,0 +1,120 @@
+/* put together the visited-topology stores (brontler -P files) of a run that
+ * was split into shards with brontler -x, or of any runs on the same taxa.
+ * license: GPLv2 or later
+ *
+ * The union of the shards' stores has the same topologies as the store of a
+ * single run, and -p prints each of them once.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// like struct spr_newickdata, which spr_parse_newick fills in
+struct mergedata{
+	char *name;
+	double length;
+};
+#define SPR_NODE_DATAPTR_TYPE struct mergedata
+#include <spr.h>
+
+const char *usage=
+"usage: sprmerge [options] tree in.ds...\n"
+" Merge dup stores into one set of topologies.  tree is the runs' start tree\n"
+" (any tree on the same taxa will do, but it counts as seen, like in brontler).\n"
+"\t-t file\tread the tree from a file instead of the command line\n"
+"\t-o out.ds\tadd them to the store out.ds (created if need be), instead of just in memory\n"
+"\t-p\tprint each topology that wasn't already in the set, one per line\n"
+"\t-q\tdon't print counts on stderr\n";
+
+static void print_topology(const struct spr_node *root, void *arg)
+{
+	spr_newick_write(stdout, NULL, root, NULL, NULL);
+	putchar('\n');
+}
+
+// the whole file, nul terminated
+static char *readfile(const char *file)
+{
+	size_t len = 0, size = 4096, got;
+	char *buf = xmalloc(size);
+	FILE *f = fopen(file, "r");
+	if (!f){ perror("sprmerge: error opening tree file"); exit(2); }
+	while ((got = fread(buf+len, 1, size-len-1, f)) > 0)
+		if ((len += got) == size-1) buf = xrealloc(buf, size *= 2);
+	if (ferror(f) || fclose(f)){ perror("sprmerge: error reading tree file"); exit(2); }
+	buf[len] = '\0';
+	return buf;
+}
+
+int main(int argc, char *argv[])
+{
+	struct spr_newicktree parsed;
+	struct spr_tree *tree;
+	const char *err, *out = NULL;
+	char *treestring = NULL;
+	int i, print = FALSE, quiet = FALSE, retval = 0;
+	long added, total = 0;
+	size_t end;
+
+	while ((i = getopt(argc, argv, "ho:pqt:")) != -1){
+		switch(i){
+		case 'h': fputs(usage, stdout); return 0;
+		case 'o': out = optarg; break;
+		case 'p': print = TRUE; break;
+		case 'q': quiet = TRUE; break;
+		case 't': treestring = readfile(optarg); break;
+		default: fputs(usage, stderr); return 1;
+		}
+	}
+	if (!treestring && optind < argc) treestring = argv[optind++];
+	if (!treestring || optind == argc){
+		fputs(usage, stderr);
+		return 1;
+	}
+
+	spr_newicktree_init(&parsed, NULL);
+	if (!spr_parse_newick(&parsed, treestring, strlen(treestring), sizeof(struct mergedata), &end, &err)){
+		fprintf(stderr, "sprmerge: bad tree at offset %zu: %s\n", end, err);
+		return 1;
+	}
+	end += strspn(treestring + end, " \t\n\r\f\v");
+	if (treestring[end]){
+		fprintf(stderr, "sprmerge: bad tree at offset %zu: trailing text after ';'\n", end);
+		return 1;
+	}
+	if (!(tree = spr_init(parsed.root, NULL, FALSE))){
+		fputs("sprmerge: couldn't init libspr\n", stderr);
+		return 2;
+	}
+	if (out && !spr_dupstore_open(tree, out, &err)){
+		fprintf(stderr, "sprmerge: %s: %s\n", out, err);
+		return 2;
+	}
+
+	for ( ; optind < argc ; optind++){
+		added = spr_dupset_merge(tree, argv[optind], print ? print_topology : NULL, NULL, &err);
+		if (added < 0){
+			fprintf(stderr, "sprmerge: %s: %s\n", argv[optind], err);
+			retval = 2;
+			break;
+		}
+		total += added;
+		if (!quiet) fprintf(stderr, "%s: %ld new topologies\n", argv[optind], added);
+	}
+	if (!quiet) fprintf(stderr, "%ld new topologies in all\n", total);
+	if (fflush(stdout)){
+		perror("sprmerge: writing topologies");
+		retval = 2;
+	}
+	if (!spr_dupstore_sync(tree)){
+		perror("sprmerge: writing store");
+		retval = 2;
+	}
+	spr_statefree(tree);
+	spr_newicktree_free(&parsed);
+	spr_staticfree();
+	return retval;
+}
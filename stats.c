@@ -0,0 +1,109 @@
+/* subtree pruning-regrafting (spr) library
+ * Peter Cordes <peter@cordes.ca>, Dalhousie University
+ * license: GPLv2 or later
+ */
+
+/* hot-path counters and latency histograms.  The hooks themselves are the
+ * SPR_COUNT and SPR_TIMED macros in spr.h, which are empty unless the library
+ * is built with -DSPR_STATS.  These functions work either way.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+
+#define SPR_PRIVATE
+#include "spr.h"
+
+#ifdef SPR_STATS
+void spr_hist_add( struct spr_hist *h, unsigned long long ticks )
+{
+	int b = ticks ? 63 - __builtin_clzll(ticks) : 0;
+	h->bucket[b < SPR_HISTBUCKETS ? b : SPR_HISTBUCKETS-1]++;
+	h->count++;
+	h->total += ticks;
+	if (ticks > h->max) h->max = ticks;
+}
+#endif
+
+int spr_stats( const struct spr_tree *tree, struct spr_stats *out )
+{
+	if (!tree->stats){
+		memset(out, 0, sizeof(*out));
+		return FALSE;
+	}
+	*out = *tree->stats;
+	return TRUE;
+}
+
+void spr_stats_reset( struct spr_tree *tree )
+{
+	if (tree->stats) memset(tree->stats, 0, sizeof(*tree->stats));
+}
+
+static void hist_add( struct spr_hist *to, const struct spr_hist *from )
+{
+	to->count += from->count;
+	to->total += from->total;
+	if (from->max > to->max) to->max = from->max;
+	for (int i=0 ; i<SPR_HISTBUCKETS ; i++) to->bucket[i] += from->bucket[i];
+}
+
+void spr_stats_add( struct spr_stats *to, const struct spr_stats *from )
+{
+	// everything before the histograms is a counter
+	unsigned long long *t = (unsigned long long *)to;
+	const unsigned long long *f = (const unsigned long long *)from;
+	for (size_t i=0 ; i < offsetof(struct spr_stats, spr)/sizeof(*t) ; i++)
+		t[i] += f[i];
+	hist_add(&to->spr, &from->spr);
+	hist_add(&to->find_dup, &from->find_dup);
+	hist_add(&to->newick, &from->newick);
+}
+
+// upper bound of the bucket holding the q-th fraction of the samples
+static unsigned long long quantile( const struct spr_hist *h, double q )
+{
+	unsigned long long want = q * h->count, seen = 0;
+	int i;
+	for (i=0 ; i<SPR_HISTBUCKETS-1 ; i++)
+		if ((seen += h->bucket[i]) > want) break;
+	return i < SPR_HISTBUCKETS-1 ? (2ULL << i) - 1 : h->max;
+}
+
+static void hist_print( const char *name, const struct spr_hist *h, FILE *stream )
+{
+	int i, lo, hi;
+	if (!h->count) return;
+	fprintf(stream, "stats: %-8s %llu calls, mean %.0f, p50 < %llu, p99 < %llu, max %llu\n",
+		name, h->count, (double)h->total / h->count,
+		quantile(h, 0.5), quantile(h, 0.99), h->max);
+	for (lo=0 ; !h->bucket[lo] ; lo++) ;
+	for (hi=SPR_HISTBUCKETS-1 ; !h->bucket[hi] ; hi--) ;
+	fprintf(stream, "stats: %-8s", "");
+	for (i=lo ; i<=hi ; i++)
+		fprintf(stream, " 2^%d:%llu", i, h->bucket[i]);
+	putc('\n', stream);
+}
+
+void spr_stats_print( const struct spr_stats *st, FILE *stream )
+{
+	fprintf(stream, "stats: spr_next_spr drew %llu moves, returned %llu\n",
+		st->next_tries, st->next_found);
+	fprintf(stream, "stats: spr rejected %llu ancestor, %llu sibling; %llu unsprs, %llu reroots\n",
+		st->reject_ancestor, st->reject_sibling, st->unsprs, st->reroots);
+	fprintf(stream, "stats: dup checks %llu: %llu hits, %llu misses, %llu sametopo, %llu cherries\n",
+		st->dup_calls, st->dup_hits, st->dup_misses, st->dup_compares, st->dup_cherries);
+	if (st->bloom_negatives + st->bloom_falsepos)
+		fprintf(stream, "stats: bloom filter answered %llu misses, %llu false positives (%.3g%%)\n",
+			st->bloom_negatives, st->bloom_falsepos,
+			100.0 * st->bloom_falsepos / (st->bloom_negatives + st->bloom_falsepos));
+#if defined(__x86_64__) || defined(__i386__)
+	fputs("stats: latencies in cycles\n", stream);
+#else
+	fputs("stats: latencies in ns\n", stream);
+#endif
+	hist_print("spr", &st->spr, stream);
+	hist_print("find_dup", &st->find_dup, stream);
+	hist_print("newick", &st->newick, stream);
+}
@@ -0,0 +1,400 @@
+/* subtree pruning-regrafting (spr) library
+ * Peter Cordes <peter@cordes.ca>, Dalhousie University
+ * license: GPLv2 or later
+ */
+
+/* on-disk dup sets: the same compact records as the in-memory set, in an
+ * mmapped file, with an open addressing index of (fp, record offset) slots.
+ * Pages are only read in when a probe touches them, so the set can be much
+ * bigger than RAM, and reopening it is just reading the header.
+ *
+ * File layout: two header copies (at 0 and 512), then the taxon names, then
+ * everything else bump-allocated from a committed end: records, indexes and
+ * logs.  The whole address range the file can grow to is reserved up front,
+ * so records never move once they're written, like in the in-memory set.
+ *
+ * Crash safety: nothing below the committed end is written except index
+ * slots, and only from a log that's already on disk.  New records and their
+ * slots go past the end (records) and into a small in-memory table (slots)
+ * until a commit, which goes:
+ *  1. write the pending slots as a log past the end, and msync everything
+ *     past the end
+ *  2. write the other header copy with the new end, the log, and seq+1, and
+ *     msync it.  This is the commit point.
+ *  3. apply the log to the index, msync, and write a header without the log.
+ * Reopening takes the valid header with the highest seq, and replays its log
+ * if it has one.  That's idempotent, so a crash during 3 is fine too.
+ * When the index would get over half full, 1 builds a whole new bigger one
+ * past the end instead of a log, and the old one is left as dead space.
+ * All of that assumes one writer, so the file is flock()ed while it's open.
+ * Read-only opens (to merge a store into another set) share the lock, never
+ * write, and just go by the committed header: they read a log instead of
+ * replaying it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define SPR_PRIVATE
+#include "spr.h"
+
+#define MAGIC "allsprDS"
+#define VERSION 1
+#define HEADER2 512		// offset of the second header copy
+#define NAMES 4096		// offset of the taxon names
+#define BATCH 65536		// pending slots before a commit
+#define GROWSTEP ((off_t)64 << 20)	// extend the file this much at a time
+#define RESERVE (sizeof(size_t) > 4 ? (size_t)1 << 40 : (size_t)1 << 30)
+
+struct header{
+	char magic[8];
+	uint32_t version, nodes, ntaxa, recsize;
+	uint64_t seq;
+	uint64_t end;		// committed bytes
+	uint64_t index, slots, count;	// index offset, size (a power of 2), slots used
+	uint64_t log, loglen;	// log to replay (offset, entries), or 0
+	uint64_t names;		// bytes of names at NAMES
+	uint64_t check;		// of everything before it
+};
+
+struct slot{
+	uint64_t fp;		// 0 for empty
+	uint64_t off;		// of the record
+};
+
+struct spr_dupstore{
+	int fd;
+	char *map;		// RESERVE bytes, of which the file is size
+	off_t size;
+	struct header h;	// the last committed one
+	uint64_t tail;		// next free byte past h.end
+	struct slot *pend;	// slots since the last commit, as a hash table
+	uint64_t *order;	// and the order they came in, for the log
+	size_t npend;
+	char **names;		// taxon id -> name, for lookups
+	int readonly;
+	pthread_mutex_t lock;
+};
+
+static uint64_t checksum( const struct header *h )
+{
+	const uint64_t *w = (const uint64_t *)h;
+	uint64_t c = 0;
+	for (size_t i=0 ; i < offsetof(struct header, check)/sizeof(*w) ; i++)
+		c = mix64(c ^ w[i]);
+	return c;
+}
+
+static int valid( const struct header *h )
+{
+	return !memcmp(h->magic, MAGIC, 8) && h->version == VERSION && h->check == checksum(h);
+}
+
+// msync [from, to), rounded out to pages
+static int flush( struct spr_dupstore *st, uint64_t from, uint64_t to )
+{
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	from &= ~(page-1);
+	return to <= from || !msync(st->map + from, to - from, MS_SYNC);
+}
+
+static int writeheader( struct spr_dupstore *st, struct header *h )
+{
+	h->seq = st->h.seq + 1;
+	h->check = checksum(h);
+	memcpy(st->map + (h->seq & 1 ? HEADER2 : 0), h, sizeof(*h));
+	if (!flush(st, 0, HEADER2 + sizeof(*h))) return FALSE;
+	st->h = *h;
+	return TRUE;
+}
+
+// n bytes past the end, 8-byte aligned, growing the file if need be
+static uint64_t reserve( struct spr_dupstore *st, uint64_t n )
+{
+	uint64_t off = (st->tail + 7) & ~(uint64_t)7;
+	if (off + n > st->size){
+		off_t size = max(st->size + GROWSTEP, (off_t)(off + n));
+		if (size > (off_t)RESERVE || ftruncate(st->fd, size)){
+			perror("allspr: growing dup store");
+			exit(2);
+		}
+		st->size = size;
+	}
+	st->tail = off + n;
+	return off;
+}
+
+static struct slot *index_of( struct spr_dupstore *st ){ return (struct slot *)(st->map + st->h.index); }
+
+// put a slot in a table, unless it's already there.  A slot with the right fp
+// and a zero off can only be a write torn by a crash, so it gets overwritten.
+static void place( struct slot *table, uint64_t mask, uint64_t fp, uint64_t off )
+{
+	uint64_t i;
+	for (i = fp & mask ; table[i].fp ; i = (i+1) & mask)
+		if (table[i].fp == fp && (table[i].off == off || !table[i].off)) break;
+	table[i].off = off;
+	table[i].fp = fp;
+}
+
+/* Make everything since the last commit durable.  FALSE on an I/O error,
+ * with the store still at the last commit. */
+static int commit( struct spr_dupstore *st )
+{
+	struct header h = st->h;
+	struct slot *table, *old = index_of(st), *log;
+	uint64_t i, j, mask, start = h.end;
+
+	if (!st->npend) return TRUE;
+	h.count += st->npend;
+	if (2 * h.count > h.slots){  // a new index, past the end
+		for (h.slots *= 2 ; 2 * h.count > h.slots ; h.slots *= 2);
+		h.index = reserve(st, h.slots * sizeof(*table));
+		table = (struct slot *)(st->map + h.index);
+		memset(table, 0, h.slots * sizeof(*table));
+		mask = h.slots - 1;
+		for (j=0 ; j < st->h.slots ; j++)
+			if (old[j].fp) place(table, mask, old[j].fp, old[j].off);
+		for (j=0 ; j < st->npend ; j++)
+			place(table, mask, st->pend[st->order[j]].fp, st->pend[st->order[j]].off);
+		h.log = h.loglen = 0;
+	}else{
+		h.log = reserve(st, st->npend * sizeof(*log));
+		h.loglen = st->npend;
+		log = (struct slot *)(st->map + h.log);
+		for (j=0 ; j < st->npend ; j++)
+			log[j] = st->pend[st->order[j]];
+	}
+	h.end = st->tail;
+	if (!flush(st, start, h.end) || !writeheader(st, &h))
+		return FALSE;
+
+	if (h.loglen){
+		mask = h.slots - 1;
+		table = index_of(st);
+		log = (struct slot *)(st->map + h.log);
+		for (i=0 ; i < h.loglen ; i++)
+			place(table, mask, log[i].fp, log[i].off);
+		if (!flush(st, h.index, h.index + h.slots * sizeof(*table)))
+			return FALSE;
+		h.log = h.loglen = 0;
+		if (!writeheader(st, &h)) return FALSE;
+	}
+	memset(st->pend, 0, 2 * BATCH * sizeof(*st->pend));
+	st->npend = 0;
+	return TRUE;
+}
+
+static void store_free( struct spr_dupstore *st )
+{
+	if (st->map && st->map != MAP_FAILED) munmap(st->map, RESERVE);
+	if (st->fd >= 0) close(st->fd);
+	if (st->names) free(st->names);
+	free(st->pend);
+	free(st->order);
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+}
+
+/* Open the store at path, creating it if need be for trees of nodes nodes
+ * with these taxon names, in id order.  Or if writable is FALSE, open it
+ * read-only, for spr_dupstore_each().  On error, returns NULL with *err set. */
+struct spr_dupstore *spr_dupstore_file( const char *path, int writable, int nodes, int ntaxa,
+	const char *const *names, size_t recsize, const char **err )
+{
+	struct spr_dupstore *st = xcalloc(1, sizeof(*st));
+	struct header a, b, *h;
+	struct stat sb;
+	uint64_t i, len;
+	char *p;
+
+	st->fd = -1;
+	st->readonly = !writable;
+	pthread_mutex_init(&st->lock, NULL);
+	if ((st->fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0666)) < 0 || fstat(st->fd, &sb)){
+		*err = strerror(errno);
+		goto fail;
+	}
+	if (flock(st->fd, (writable ? LOCK_EX : LOCK_SH) | LOCK_NB)){  // released when the fd is closed
+		*err = errno == EWOULDBLOCK ? "store in use by another process" : strerror(errno);
+		goto fail;
+	}
+	if ((size_t)sb.st_size > RESERVE){
+		*err = "too big to map";
+		goto fail;
+	}
+	st->map = mmap(NULL, RESERVE, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED | MAP_NORESERVE, st->fd, 0);
+	if (st->map == MAP_FAILED){
+		*err = strerror(errno);
+		goto fail;
+	}
+	st->size = sb.st_size;
+	if (writable){
+		st->pend = xcalloc(2 * BATCH, sizeof(*st->pend));
+		st->order = xmalloc(BATCH * sizeof(*st->order));
+	}
+
+	if (st->size == 0 && writable){  // new
+		for (len=0, i=0 ; i < (uint64_t)ntaxa ; i++) len += strlen(names[i]) + 1;
+		st->tail = NAMES + len;
+		reserve(st, 0);
+		for (p = st->map + NAMES, i=0 ; i < (uint64_t)ntaxa ; i++)
+			p = stpcpy(p, names[i]) + 1;
+		memset(&a, 0, sizeof(a));
+		memcpy(a.magic, MAGIC, 8);
+		a.version = VERSION;
+		a.nodes = nodes;
+		a.ntaxa = ntaxa;
+		a.recsize = recsize;
+		a.names = len;
+		a.slots = 1024;
+		a.index = reserve(st, a.slots * sizeof(struct slot));
+		memset(st->map + a.index, 0, a.slots * sizeof(struct slot));
+		a.end = st->tail;
+		if (!flush(st, NAMES, a.end) || !writeheader(st, &a)){
+			*err = strerror(errno);
+			goto fail;
+		}
+	}else{
+		if (st->size < NAMES){
+			*err = "not a dup store";
+			goto fail;
+		}
+		memcpy(&a, st->map, sizeof(a));
+		memcpy(&b, st->map + HEADER2, sizeof(b));
+		if (!valid(&a) && !valid(&b)){
+			*err = "not a dup store, or both headers are damaged";
+			goto fail;
+		}
+		h = !valid(&b) || (valid(&a) && a.seq > b.seq) ? &a : &b;
+		if (h->end > (uint64_t)st->size){
+			*err = "truncated";
+			goto fail;
+		}
+		st->h = *h;
+		st->tail = h->end;
+		if (st->h.nodes != (uint32_t)nodes || st->h.ntaxa != (uint32_t)ntaxa || st->h.recsize != recsize){
+			*err = "it's for trees of a different size";
+			goto fail;
+		}
+		if (st->h.loglen && writable){  // crashed while applying it
+			struct slot *log = (struct slot *)(st->map + st->h.log);
+			for (i=0 ; i < st->h.loglen ; i++)
+				place(index_of(st), st->h.slots - 1, log[i].fp, log[i].off);
+			a = st->h;
+			a.log = a.loglen = 0;
+			if (!flush(st, a.index, a.index + a.slots * sizeof(struct slot)) || !writeheader(st, &a)){
+				*err = strerror(errno);
+				goto fail;
+			}
+		}
+	}
+
+	st->names = xmalloc(ntaxa * sizeof(*st->names));
+	for (p = st->map + NAMES, i=0 ; i < (uint64_t)ntaxa ; i++, p += strlen(p) + 1)
+		st->names[i] = p;
+	return st;
+ fail:
+	store_free(st);
+	return NULL;
+}
+
+// id of a taxon name, or -1.  Only called when attaching, so a linear search is fine
+int spr_dupstore_taxon( const struct spr_dupstore *st, const char *name )
+{
+	for (uint32_t i=0 ; i < st->h.ntaxa ; i++)
+		if (!strcmp(st->names[i], name)) return i;
+	return -1;
+}
+
+void spr_dupstore_lock( struct spr_dupstore *st ){ pthread_mutex_lock(&st->lock); }
+void spr_dupstore_unlock( struct spr_dupstore *st ){ pthread_mutex_unlock(&st->lock); }
+
+/* The stored records with fingerprint fp, one per call, starting from a
+ * zeroed cursor: the index, then the pending table.  NULL when done. */
+const void *spr_dupstore_next( struct spr_dupstore *st, unsigned long long fp, struct spr_dupstore_cursor *c )
+{
+	const struct slot *s;
+	uint64_t mask;
+
+	if (!c->pending){
+		mask = st->h.slots - 1;
+		for (s = index_of(st) ; s[(fp + c->i) & mask].fp ; c->i++)
+			if (s[(fp + c->i) & mask].fp == fp)
+				return st->map + s[(fp + c->i++) & mask].off;
+		c->pending = TRUE;
+		c->i = 0;
+	}
+	mask = 2*BATCH - 1;
+	for (s = st->pend ; s[(fp + c->i) & mask].fp ; c->i++)
+		if (s[(fp + c->i) & mask].fp == fp)
+			return st->map + s[(fp + c->i++) & mask].off;
+	return NULL;
+}
+
+/* the committed records, one per call, starting from *i = 0.  NULL when done.
+ * Those in an unapplied log (only a read-only open has one) come after the
+ * index, and may come up twice. */
+const void *spr_dupstore_each( const struct spr_dupstore *st, uint64_t *i )
+{
+	const struct slot *s = (const struct slot *)(st->map + st->h.index);
+	const struct slot *log = (const struct slot *)(st->map + st->h.log);
+	for ( ; *i < st->h.slots ; ++*i)
+		if (s[*i].fp) return st->map + s[(*i)++].off;
+	if (*i - st->h.slots < st->h.loglen)
+		return st->map + log[(*i)++ - st->h.slots].off;
+	return NULL;
+}
+
+// room for a record past the end.  Only spr_dupstore_insert() it, or nothing
+void *spr_dupstore_alloc( struct spr_dupstore *st )
+{
+	return st->map + reserve(st, st->h.recsize);
+}
+
+void spr_dupstore_insert( struct spr_dupstore *st, unsigned long long fp, const void *rec )
+{
+	uint64_t i, mask = 2*BATCH - 1;
+	for (i = fp & mask ; st->pend[i].fp ; i = (i+1) & mask);
+	st->pend[i].fp = fp;
+	st->pend[i].off = (const char *)rec - st->map;
+	st->order[st->npend++] = i;
+	if (st->npend == BATCH && !commit(st)){
+		perror("allspr: writing dup store");
+		exit(2);
+	}
+}
+
+int spr_dupstore_commit( struct spr_dupstore *st )
+{
+	int ok;
+	spr_dupstore_lock(st);
+	ok = commit(st);
+	spr_dupstore_unlock(st);
+	return ok;
+}
+
+unsigned long long spr_dupstore_count( const struct spr_dupstore *st )
+{
+	return st->h.count + st->npend;
+}
+
+void spr_dupstore_close( struct spr_dupstore *st )
+{
+	if (!st->readonly){  // a read-only one is left just as we found it
+		if (!commit(st)) perror("allspr: writing dup store");
+		else if (ftruncate(st->fd, st->h.end))  // drop the slack past the end
+			perror("allspr: truncating dup store");
+	}
+	store_free(st);
+}
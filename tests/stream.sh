@@ -0,0 +1,24 @@
+#!/bin/sh
+# brontler -M should enumerate each tree in the file as if it were run alone.
+# Mode 1 with -T, so the SPR order (and so what gets found) has to match too.
+# usage: tests/stream.sh [brontler]
+B=${1:-./brontler}
+T=${TMPDIR:-/tmp}/allspr-stream.$$
+trap 'rm -f $T.*' EXIT
+fail=0
+
+for s in 1 2 3; do $B -g 12 -s $s -p; done > $T.trees || exit 2
+for mode in 0 1; do
+	$B -M -t $T.trees -m$mode -T 500 > $T.stream || exit 2
+	: > $T.single
+	while read tree; do
+		$B -m$mode -T 500 "$tree" >> $T.single || exit 2
+	done < $T.trees
+	if cmp -s $T.stream $T.single; then
+		echo "stream.sh: mode $mode ok"
+	else
+		echo "stream.sh: mode $mode: -M output differs from single runs" >&2
+		fail=1
+	fi
+done
+exit $fail
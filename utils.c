@@ -38,3 +38,76 @@ void *xrealloc (void *p, size_t n)
 	}
 	return p;
 }
+
+
+/* arena allocator: carve allocations out of big blocks.
+ * Blocks are never shrunk, and everything is freed at once. */
+struct spr_arenablock{
+	struct spr_arenablock *prev;
+	size_t size;
+};
+#define ARENA_ALIGN 16
+#define ARENA_HDR ((sizeof(struct spr_arenablock)+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+void spr_arena_init(struct spr_arena *a, size_t blocksize)
+{
+	a->blocks = NULL;
+	a->next = a->end = NULL;
+	a->blocksize = blocksize ? blocksize : 64*1024;
+}
+
+void *spr_arena_alloc(struct spr_arena *a, size_t n)
+{
+	void *p;
+	n = (n + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+	if (n > (size_t)(a->end - a->next)){
+		size_t size = max(a->blocksize, n + ARENA_HDR);
+		struct spr_arenablock *b = xmalloc(size);
+		b->prev = a->blocks;
+		b->size = size;
+		a->blocks = b;
+		a->next = (char *)b + ARENA_HDR;
+		a->end = (char *)b + size;
+	}
+	p = a->next;
+	a->next += n;
+	return p;
+}
+
+void spr_arena_handoff(struct spr_arena *from, struct spr_arena *to)
+{
+	struct spr_arenablock *oldest, *head;
+	if (!from->blocks) return;
+	for (oldest = from->blocks ; oldest->prev ; oldest = oldest->prev);
+	do{
+		head = to->blocks;
+		oldest->prev = head;
+	}while (!__sync_bool_compare_and_swap(&to->blocks, head, from->blocks));
+	from->blocks = NULL;
+	from->next = from->end = NULL;
+}
+
+void spr_arena_reset(struct spr_arena *a)
+{
+	struct spr_arenablock *b = a->blocks;
+	size_t total = 0;
+	if (!b) return;
+	if (b->prev){ // replace them all with one block, so next time fits in it
+		for ( ; b ; b = b->prev) total += b->size;
+		spr_arena_free(a);
+		spr_arena_alloc(a, total - ARENA_HDR);
+		b = a->blocks;
+	}
+	a->next = (char *)b + ARENA_HDR;
+}
+
+void spr_arena_free(struct spr_arena *a)
+{
+	struct spr_arenablock *b, *prev;
+	for (b = a->blocks ; b ; b = prev){
+		prev = b->prev;
+		free(b);
+	}
+	a->blocks = NULL;
+	a->next = a->end = NULL;
+}